@@ -0,0 +1,349 @@
+/* bench: microbenchmarks for the hot parts of libmyc.
+ *
+ *     make bench                    # runs everything, writes bench.csv
+ *     ./bench out=new.csv baseline=bench.csv samples=31 dGet fifo
+ *
+ * Each benchmark is timed over `samples` runs of n operations, where n is
+ * picked up front so one run takes about BENCH_RUN_NS. The CSV has one
+ * row per benchmark: the min/median/p90/p99 ns per operation across the
+ * runs, millions of operations a second at the median, and MB/s at the
+ * median for the ones that move bytes. Given a baseline CSV, the median
+ * is also printed as a ratio against it.
+ * Any other arguments pick benchmarks whose names start with them.
+ */
+#include "libmyc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#ifndef BENCH_RUN_NS
+#define BENCH_RUN_NS 20000000LL
+#endif
+#define BLOCK 1024
+#define READ_DOUBLES (1<<20)
+
+typedef struct {
+	char *name;
+	void (*setup)(void);
+	void (*run)(long n);
+	long bytes;
+} bench;
+
+static volatile double sink_d;
+static volatile long sink_l;
+static int devnull;
+static char *readfile;
+static int readfd = -1;
+static double dblock[BLOCK];
+static int iblock[BLOCK];
+static dArray arr3;
+static FIFO fifo;
+static Counter counter;
+static printfuncs *pf;
+
+/* output to /dev/null through the usual selected-fd machinery */
+static void to_null (void) { my_select(devnull); }
+
+static void b_writei (long n) { long i; for (i = 0; i < n; i++) writei((int)i); }
+static void b_writed (long n) { long i; for (i = 0; i < n; i++) writed((double)i); }
+static void b_writeia (long n) { long i; for (i = 0; i < n; i++) writeia(iblock,BLOCK); }
+static void b_writeda (long n) { long i; for (i = 0; i < n; i++) writeda(dblock,BLOCK); }
+
+static void reopen (void) {
+	if (readfd >= 0) my_close(readfd);
+	readfd = my_open(readfile);
+}
+static void b_readd (long n) {
+	double d = 0;
+	long i;
+	for (i = 0; i < n; i++)
+		if (!readd(readfd,&d)) { reopen(); readd(readfd,&d); }
+	sink_d = d;
+}
+static void b_readda (long n) {
+	long i;
+	for (i = 0; i < n; i++)
+		if (readda(readfd,dblock,BLOCK) < BLOCK) reopen();
+}
+static void setup_read (void) {
+	static char name[] = "/tmp/libmyc-bench-XXXXXX";
+	int fd, old, i;
+	if (!readfile) {
+		if ((fd = mkstemp(name)) < 0) die("Couldn't make %s\n",name);
+		close(fd);
+		readfile = name;
+		old = my_select(my_openout(readfile));
+		for (i = 0; i < READ_DOUBLES; i++) writed((double)i);
+		my_close(my_select(old));
+	}
+	reopen();
+}
+
+static void setup_arr (void) {
+	if (!arr3) arr3 = initdArray(3,64,64,64);
+}
+static void b_dGet (long n) {
+	double s = 0;
+	long i;
+	for (i = 0; i < n; i++) s += dGet(arr3,(int)(i&63),(int)((i>>6)&63),(int)((i>>12)&63));
+	sink_d = s;
+}
+static void b_dSet (long n) {
+	long i;
+	for (i = 0; i < n; i++) dSet(arr3,(int)(i&63),(int)((i>>6)&63),(int)((i>>12)&63),(double)i);
+}
+static void b_dGet3 (long n) {
+	double s = 0;
+	long i;
+	for (i = 0; i < n; i++) s += dGet3(arr3,(int)(i&63),(int)((i>>6)&63),(int)((i>>12)&63));
+	sink_d = s;
+}
+
+static void b_malloc64 (long n) {
+	long i;
+	for (i = 0; i < n; i++) my_free(my_malloc(64,"bench"));
+}
+static void b_malloc4k (long n) {
+	long i;
+	for (i = 0; i < n; i++) my_free(my_malloc(4096,"bench"));
+}
+
+static void setup_fifo (void) {
+	if (fifo) return;
+	fifo = fifo_new();
+	fifo_push(fifo,"head");
+}
+static void b_fifo (long n) {
+	long i;
+	for (i = 0; i < n; i++) {
+		fifo_push(fifo,"x");
+		sink_l += (long)fifo_pop(fifo);
+	}
+}
+
+static void setup_count (void) {
+	quiet = 1;
+	if (!counter) counter = gen_counter("wait=3600",NULL);
+}
+static void setup_count_threaded (void) {
+	quiet = 1;
+	if (counter) free_counter(counter);
+	counter = gen_counter("threaded","wait=3600",NULL);
+}
+static void b_count (long n) { long i; for (i = 0; i < n; i++) count(counter); }
+static CountSlot count_here;
+static void setup_count_local (void) {
+	setup_count_threaded();
+	count_here = count_slot(counter);
+}
+static void b_count_local (long n) { long i; for (i = 0; i < n; i++) count_local(count_here,1); }
+
+static void setup_pf_txt (void) { to_null(); pf = pf_named("txt"); }
+static void setup_pf_bin (void) { to_null(); pf = pf_named("bin"); }
+static void b_pf_D (long n) { long i; for (i = 0; i < n; i++) pf->D(i * 0.125); }
+static void b_pf_I (long n) { long i; for (i = 0; i < n; i++) pf->I((int)i); }
+static void b_pf_DRow (long n) { long i; for (i = 0; i < n; i++) pf->DRow(dblock,BLOCK); }
+
+/* MPMC: p producers push the values 1..n between them while p consumers
+ * pop them, then one stop value per consumer. An operation is one value
+ * through the queue; every run checks the count and sum that came out. */
+#define MPMC_CAP 1024
+#define MPMC_STOP ((char *)-1)
+static MPMC mq;
+static int mpmc_p;
+static long mpmc_n;
+static atomic_long mpmc_got;
+static atomic_ullong mpmc_sum;
+static void *mpmc_producer (void *v) {
+	long i;
+	for (i = (long)v + 1; i <= mpmc_n; i += mpmc_p)
+		while (!mpmc_push(mq,(char *)i)) sched_yield();
+	return NULL;
+}
+static void *mpmc_consumer (void *v) {
+	unsigned long long sum = 0;
+	long got = 0;
+	char *x;
+	(void)v;
+	for (;;) {
+		if (!mpmc_pop(mq,&x)) { sched_yield(); continue; }
+		if (x == MPMC_STOP) break;
+		sum += (unsigned long)x;
+		got++;
+	}
+	atomic_fetch_add(&mpmc_got,got);
+	atomic_fetch_add(&mpmc_sum,sum);
+	return NULL;
+}
+static void setup_mpmc (void) { if (!mq) mq = mpmc_new(MPMC_CAP); }
+static void b_mpmc (long n, int p) {
+	pthread_t *th = (pthread_t *)my_malloc(2*p*sizeof(pthread_t),"mpmc threads");
+	unsigned long long want = (unsigned long long)n * (n + 1) / 2;
+	long i;
+	mpmc_p = p;
+	mpmc_n = n;
+	atomic_store(&mpmc_got,0);
+	atomic_store(&mpmc_sum,0);
+	for (i = 0; i < p; i++) pthread_create(&th[p+i],NULL,mpmc_consumer,NULL);
+	for (i = 0; i < p; i++) pthread_create(&th[i],NULL,mpmc_producer,(void *)i);
+	for (i = 0; i < p; i++) pthread_join(th[i],NULL);
+	for (i = 0; i < p; i++) while (!mpmc_push(mq,MPMC_STOP)) sched_yield();
+	for (i = 0; i < p; i++) pthread_join(th[p+i],NULL);
+	if (atomic_load(&mpmc_got) != n || atomic_load(&mpmc_sum) != want)
+		die("mpmc/%d lost values: popped %ld of %ld, sum %llu of %llu\n",p,
+			atomic_load(&mpmc_got),n,atomic_load(&mpmc_sum),want);
+	my_free(th);
+}
+static void b_mpmc1 (long n) { b_mpmc(n,1); }
+static void b_mpmc2 (long n) { b_mpmc(n,2); }
+static void b_mpmc4 (long n) { b_mpmc(n,4); }
+static void b_mpmc8 (long n) { b_mpmc(n,8); }
+
+static bench benches[] = {
+	{ "writei", to_null, b_writei, sizeof(int) },
+	{ "writed", to_null, b_writed, sizeof(double) },
+	{ "writeia/1024", to_null, b_writeia, BLOCK*sizeof(int) },
+	{ "writeda/1024", to_null, b_writeda, BLOCK*sizeof(double) },
+	{ "readd", setup_read, b_readd, sizeof(double) },
+	{ "readda/1024", setup_read, b_readda, BLOCK*sizeof(double) },
+	{ "dGet", setup_arr, b_dGet, 0 },
+	{ "dSet", setup_arr, b_dSet, 0 },
+	{ "dGet3", setup_arr, b_dGet3, 0 },
+	{ "my_malloc/64", NULL, b_malloc64, 0 },
+	{ "my_malloc/4096", NULL, b_malloc4k, 0 },
+	{ "fifo_push+pop", setup_fifo, b_fifo, 0 },
+	{ "mpmc/1", setup_mpmc, b_mpmc1, 0 },
+	{ "mpmc/2", setup_mpmc, b_mpmc2, 0 },
+	{ "mpmc/4", setup_mpmc, b_mpmc4, 0 },
+	{ "mpmc/8", setup_mpmc, b_mpmc8, 0 },
+	{ "count", setup_count, b_count, 0 },
+	{ "count/threaded", setup_count_threaded, b_count, 0 },
+	{ "count/local", setup_count_local, b_count_local, 0 },
+	{ "pf_txt/D", setup_pf_txt, b_pf_D, 0 },
+	{ "pf_txt/I", setup_pf_txt, b_pf_I, 0 },
+	{ "pf_txt/DRow", setup_pf_txt, b_pf_DRow, BLOCK*sizeof(double) },
+	{ "pf_bin/D", setup_pf_bin, b_pf_D, sizeof(double) },
+	{ "pf_bin/DRow", setup_pf_bin, b_pf_DRow, BLOCK*sizeof(double) },
+	{ NULL }
+};
+
+static int by_value (const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+static double pct (double *sorted, int n, double p) {
+	int i = (int)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+/* baseline medians, by name */
+static int nbase;
+static char **base_names;
+static double *base_p50;
+static void read_baseline (char *file) {
+	char line[512], *name, *p50;
+	FILE *f = fopen(file,"r");
+	int i;
+	if (!f) die("Couldn't read baseline %s\n",file);
+	for (i = 0; benches[i].name; i++);
+	base_names = (char **)my_malloc(i*sizeof(char *),"baseline names");
+	base_p50 = my_mallocd(i,"baseline medians");
+	while (fgets(line,sizeof(line),f) && nbase < i) {
+		if (starts_with(line,"name,")) continue;
+		name = strtok(line,",");
+		strtok(NULL,",");
+		strtok(NULL,",");
+		strtok(NULL,",");
+		p50 = strtok(NULL,",");
+		if (!name || !p50) continue;
+		base_names[nbase] = my_strcpy(name);
+		base_p50[nbase++] = parse_d(p50,NULL);
+	}
+	fclose(f);
+}
+static double baseline (char *name) {
+	int i;
+	for (i = 0; i < nbase; i++) if (is(base_names[i],name)) return base_p50[i];
+	return 0;
+}
+
+static int wanted (char **filters, int nfilt, char *name) {
+	int i;
+	if (!nfilt) return 1;
+	for (i = 0; i < nfilt; i++) if (starts_with(name,filters[i])) return 1;
+	return 0;
+}
+
+int main (int argc, char **argv) {
+	char *out = "bench.csv", *base = NULL, **filters;
+	int samples = 31, nfilt = 0, i, k, csv, old;
+	long n;
+	long long t0, t;
+	double *ns, b, mbs;
+	StrBuf line;
+	StrView opt;
+	initialize_globals();
+	filters = (char **)my_malloc(argc*sizeof(char *),"filters");
+	for (argv++; *argv; argv++) {
+		str_kv(*argv,&opt,NULL);
+		if (sv_is(opt,"out")) out = get_next_argp(&argv,*argv);
+		else if (sv_is(opt,"baseline")) base = get_next_argp(&argv,*argv);
+		else if (sv_is(opt,"samples")) samples = get_next_argpi(&argv,*argv);
+		else filters[nfilt++] = *argv;
+	}
+	if (samples < 1) samples = 1;
+	if (base) read_baseline(base);
+	devnull = open("/dev/null",O_WRONLY);
+	if (devnull < 0) die("Couldn't open /dev/null\n");
+	for (i = 0; i < BLOCK; i++) { dblock[i] = i * 1.0625; iblock[i] = i; }
+	ns = my_mallocd(samples,"samples");
+	line = sb_new(256);
+	csv = my_openout(out);
+	old = my_select(csv);
+	writes("name,n,ns_min,ns_p50,ns_p90,ns_p99,mb_per_s,mops_per_s\n");
+	my_select(old);
+	fprintf(stderr,"%-18s %12s %10s %10s %10s %10s %10s %10s%s\n","benchmark","n",
+		"min","p50","p90","p99","MB/s","Mops/s",base?"   vs base":"");
+	for (i = 0; benches[i].name; i++) {
+		if (!wanted(filters,nfilt,benches[i].name)) continue;
+		if (benches[i].setup) benches[i].setup();
+		/* grow n until one run takes long enough to time */
+		for (n = 1; ; n *= 2) {
+			t0 = now_ns();
+			benches[i].run(n);
+			t = now_ns() - t0;
+			if (t >= BENCH_RUN_NS / 8 || n >= (1L<<40)) break;
+		}
+		n = (long)((double)n * BENCH_RUN_NS / (t > 0 ? t : 1)) + 1;
+		for (k = 0; k < samples; k++) {
+			if (benches[i].setup) benches[i].setup();
+			t0 = now_ns();
+			benches[i].run(n);
+			ns[k] = (double)(now_ns() - t0) / n;
+		}
+		my_flush(devnull);
+		qsort(ns,samples,sizeof(double),by_value);
+		mbs = benches[i].bytes ? benches[i].bytes * 1e3 / pct(ns,samples,.5) : 0;
+		sb_reset(line);
+		sb_appendf(line,"%s,%ld,",benches[i].name,n);
+		sb_appendf(line,"%.3f,%.3f,%.3f,%.3f,%.1f,%.3f\n",ns[0],pct(ns,samples,.5),
+			pct(ns,samples,.9),pct(ns,samples,.99),mbs,1e3/pct(ns,samples,.5));
+		old = my_select(csv);
+		writebytes(line->s,line->len);
+		my_select(old);
+		fprintf(stderr,"%-18s %12ld %10.2f %10.2f %10.2f %10.2f %10.1f %10.2f",
+			benches[i].name,n,ns[0],pct(ns,samples,.5),pct(ns,samples,.9),
+			pct(ns,samples,.99),mbs,1e3/pct(ns,samples,.5));
+		if ((b = baseline(benches[i].name)) > 0)
+			fprintf(stderr,"   %6.2fx",pct(ns,samples,.5) / b);
+		fprintf(stderr,"\n");
+	}
+	my_close(csv);
+	if (readfile) unlink(readfile);
+	return 0;
+}
@@ -0,0 +1,535 @@
+/* check: correctness tests for libmyc.
+ *
+ *     make check
+ *
+ * Each vector kernel the CPU supports is run on the same inputs as the
+ * scalar one and has to agree to within rounding (sums get reassociated,
+ * so not bit for bit). The number formatters and parsers have to match
+ * printf and strtod. Baum-Welch's expected counts are checked against
+ * brute force over every state path of short sequences, and so are
+ * checkpointed Viterbi's paths (and against a full backpointer table on
+ * long ones). The MPMC queue's batch calls are run from several
+ * threads at once through a queue small enough to keep hitting full and
+ * empty. Prints one line per failure and exits 1 if any.
+ */
+#include "libmyc.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define MAXN 1037 // odd, so every vector tail gets exercised
+#define TOL 1e-12
+
+static int failures;
+static char *level_name[] = { "scalar", "sse2", "avx2" };
+
+static void agree (char *what, int level, long n, double want, double got) {
+	double scale = fabs(want) > 1 ? fabs(want) : 1;
+	if (want == got || (isinf(want) && want == got)) return;
+	if (fabs(want - got) <= TOL * scale * (n > 1 ? n : 1)) return;
+	printf("FAIL %s/%s n=%ld: scalar %.17g, got %.17g\n",what,level_name[level],n,want,got);
+	failures++;
+}
+static void agree_vec (char *what, int level, long n, double *want, double *got) {
+	long i;
+	for (i = 0; i < n; i++) agree(what,level,n,want[i],got[i]);
+}
+
+static void fill (Rng r, double *x, long n, double lo, double hi) {
+	long i;
+	for (i = 0; i < n; i++) x[i] = lo + (hi - lo) * rng_double(r);
+}
+
+/* every kernel at every length up to MAXN, against VEC_SCALAR */
+static void check_kernels (int level) {
+	static double x[MAXN], y[MAXN], a[MAXN], b[MAXN];
+	struct rng r;
+	double want, got;
+	long n;
+	rng_seed(&r,1234);
+	for (n = 0; n <= MAXN; n += (n < 40 ? 1 : 97)) {
+		fill(&r,x,n,-3,3);
+		fill(&r,y,n,-3,3);
+
+		vec_select(VEC_SCALAR); want = vec_sum(x,n);
+		vec_select(level); got = vec_sum(x,n);
+		agree("vec_sum",level,n,want,got);
+
+		vec_select(VEC_SCALAR); want = vec_dot(x,y,n);
+		vec_select(level); got = vec_dot(x,y,n);
+		agree("vec_dot",level,n,want,got);
+
+		vec_select(VEC_SCALAR); want = vec_max(x,n);
+		vec_select(level); got = vec_max(x,n);
+		agree("vec_max",level,n,want,got);
+
+		vec_select(VEC_SCALAR); want = vec_logsumexp(x,n);
+		vec_select(level); got = vec_logsumexp(x,n);
+		agree("vec_logsumexp",level,n,want,got);
+
+		memcpy(a,x,n*sizeof(double)); memcpy(b,x,n*sizeof(double));
+		vec_select(VEC_SCALAR); vec_scale(a,n,0.37);
+		vec_select(level); vec_scale(b,n,0.37);
+		agree_vec("vec_scale",level,n,a,b);
+
+		memcpy(a,y,n*sizeof(double)); memcpy(b,y,n*sizeof(double));
+		vec_select(VEC_SCALAR); vec_axpy(a,x,n,-1.25);
+		vec_select(level); vec_axpy(b,x,n,-1.25);
+		agree_vec("vec_axpy",level,n,a,b);
+
+		fill(&r,a,n,0,1);
+		memcpy(b,a,n*sizeof(double));
+		vec_select(VEC_SCALAR); want = vec_normalize(a,n);
+		vec_select(level); got = vec_normalize(b,n);
+		agree("vec_normalize",level,n,want,got);
+		agree_vec("vec_normalize",level,n,a,b);
+	}
+	/* exp's clamp and the empty/-inf cases */
+	x[0] = -800; x[1] = -1000; x[2] = 700; x[3] = -INFINITY;
+	for (n = 1; n <= 4; n++) {
+		vec_select(VEC_SCALAR); want = vec_logsumexp(x,n);
+		vec_select(level); got = vec_logsumexp(x,n);
+		agree("vec_logsumexp/extremes",level,n,want,got);
+	}
+}
+
+/* zero-length last axes used to divide by zero */
+static void check_empty_rows (void) {
+	dArray a = initdArray(2,5,0), b = initdArray(1,0);
+	dNormalizeLast(a);
+	dNormalizeLast(b);
+	free_dArr(a);
+	free_dArr(b);
+}
+
+static void expect (char *what, long want, long got) {
+	if (want == got) return;
+	printf("FAIL %s: want %ld, got %ld\n",what,want,got);
+	failures++;
+}
+
+/* number formatting against printf/strtod: integers at every power of ten
+ * and the type limits, fmt_fixed at random magnitudes and precisions
+ * (and a precision far past FMT_PREC_MAX on DBL_MAX, which has to stay
+ * inside FMT_MAX), fmt_double and parse_d reading back bit for bit */
+static void check_fmt_int (long long v) {
+	char want[32], got[FMT_MAX], *end;
+	int n = fmt_ll(got,v);
+	snprintf(want,sizeof(want),"%lld",v);
+	if (strcmp(want,got) || n != (int)strlen(want)) {
+		printf("FAIL fmt_ll: want %s, got %s (%d)\n",want,got,n);
+		failures++;
+	}
+	if (parse_ll(got,&end) != v || *end) {
+		printf("FAIL parse_ll %s\n",got);
+		failures++;
+	}
+}
+static void check_fmt_fixed (double d, int prec) {
+	char want[FMT_MAX+16], got[FMT_MAX];
+	int n = fmt_fixed(got,d,prec);
+	snprintf(want,sizeof(want),"%.*f",prec,d);
+	if (strcmp(want,got) || n != (int)strlen(want)) {
+		printf("FAIL fmt_fixed %.17g prec %d: want %s, got %s (%d)\n",d,prec,want,got,n);
+		failures++;
+	}
+}
+static void check_roundtrip (double d) {
+	char buf[FMT_MAX], *end;
+	double back;
+	int n = fmt_double(buf,d);
+	back = parse_d(buf,&end);
+	if (n != (int)strlen(buf) || memcmp(&back,&d,sizeof(d)) || *end
+			|| strtod(buf,NULL) != d) {
+		printf("FAIL fmt_double %.17g: %s reads back as %.17g\n",d,buf,back);
+		failures++;
+	}
+}
+static void check_parse (char *s) {
+	char *e1, *e2;
+	double want = strtod(s,&e1), got = parse_d(s,&e2);
+	if (memcmp(&want,&got,sizeof(want)) || e1 != e2) {
+		printf("FAIL parse_d \"%s\": want %.17g (+%d), got %.17g (+%d)\n",
+			s,want,(int)(e1-s),got,(int)(e2-s));
+		failures++;
+	}
+}
+static void check_fmt (void) {
+	struct { char buf[FMT_MAX]; char guard[16]; } big;
+	static char *odd[] = { "0", "-0", "  12.5xyz", "1e", "1e+", ".5", "5.",
+		"-.e3", "9007199254740993", "1e22", "1e23", "1e-22", "1e-23",
+		"123456789012345678901", "1e400", "1e-400", "0x1p3", "inf", "nan",
+		"4.9406564584124654e-324", "2.2250738585072014e-308", NULL };
+	unsigned long long bits;
+	long long p;
+	char buf[64];
+	struct rng r;
+	double d;
+	int i, k, n;
+	rng_seed(&r,5678);
+	for (p = 1; p > 0 && p <= LLONG_MAX / 10; p *= 10) {
+		check_fmt_int(p-1); check_fmt_int(p); check_fmt_int(p+1);
+		check_fmt_int(-p-1); check_fmt_int(-p); check_fmt_int(-p+1);
+	}
+	check_fmt_int(LLONG_MAX);
+	check_fmt_int(LLONG_MIN);
+	n = fmt_ull(buf,ULLONG_MAX);
+	if (strcmp(buf,"18446744073709551615") || n != 20) {
+		printf("FAIL fmt_ull max: %s\n",buf);
+		failures++;
+	}
+
+	check_fmt_fixed(0.125,2); // ties go to even, like printf
+	check_fmt_fixed(0.375,2);
+	check_fmt_fixed(2.5,0);
+	check_fmt_fixed(-0.0,3);
+	check_fmt_fixed(-0.0004,3);
+	check_fmt_fixed(1e17,1);
+	check_fmt_fixed(INFINITY,2);
+	for (i = 0; i < 20000; i++) {
+		d = (rng_double(&r) - 0.5) * pow(10,(int)rng_below(&r,34) - 12);
+		check_fmt_fixed(d,(int)rng_below(&r,21));
+	}
+	memset(big.guard,'#',sizeof(big.guard));
+	n = fmt_fixed(big.buf,-DBL_MAX,100000);
+	if (n >= FMT_MAX || n != (int)strlen(big.buf) || big.guard[0] != '#') {
+		printf("FAIL fmt_fixed -DBL_MAX: %d chars, FMT_MAX is %d\n",n,FMT_MAX);
+		failures++;
+	}
+	check_fmt_fixed(-DBL_MAX,FMT_PREC_MAX);
+
+	check_roundtrip(0.0); check_roundtrip(-0.0);
+	check_roundtrip(DBL_MAX); check_roundtrip(DBL_MIN);
+	check_roundtrip(4.9406564584124654e-324);
+	check_roundtrip(0.1); check_roundtrip(1.0/3); check_roundtrip(1e21); check_roundtrip(1e-7);
+	check_roundtrip(INFINITY); check_roundtrip(-INFINITY);
+	for (i = 0; i < 100000; i++) {
+		do {
+			bits = rng_next(&r);
+			memcpy(&d,&bits,sizeof(d));
+		} while (!isfinite(d));
+		check_roundtrip(d);
+		k = (int)rng_below(&r,19);
+		snprintf(buf,sizeof(buf),"%.*e",k,d);
+		check_parse(buf);
+		snprintf(buf,sizeof(buf),"%.*g",k+1,rng_double(&r)*1e6);
+		check_parse(buf);
+	}
+	for (i = 0; odd[i]; i++) check_parse(odd[i]);
+}
+
+/* HMMs: on sequences short enough to enumerate every state path, the
+ * scaled forward-backward's log-likelihood and expected counts have to
+ * match the brute-force sums; on a long one, where unscaled
+ * probabilities underflow, the log-likelihood has to match a log-space
+ * forward pass and the counts have to add up to the sequence length */
+#define HMM_N 3
+#define HMM_M 4
+
+static void random_rows (Rng r, dArray a) {
+	long i, len = a->dim[a->ndim-1];
+	for (i = 0; i < a->size; i++) a->data[i] = 0.05 + rng_double(r);
+	for (i = 0; i < a->size; i += len) vec_normalize(a->data+i,len);
+}
+static HMM random_hmm (Rng r) {
+	HMM h = hmm_new(HMM_N,HMM_M);
+	random_rows(r,h->sig);
+	random_rows(r,h->gam);
+	random_rows(r,h->eta);
+	hmm_prepare(h);
+	return h;
+}
+static double path_prob (HMM h, int *seq, int *s, long T) {
+	double p = h->sig->data[s[0]] * h->eta->data[s[0]*HMM_M+seq[0]];
+	long t;
+	for (t = 1; t < T; t++)
+		p *= h->gam->data[s[t-1]*HMM_N+s[t]] * h->eta->data[s[t]*HMM_M+seq[t]];
+	return p;
+}
+/* every path in turn, counting in base N; returns the total probability
+ * and adds each path's expected counts (unnormalized) into acc */
+static double brute_force (HMM h, int *seq, long T, HMM acc) {
+	int s[16];
+	double p, total = 0;
+	long t;
+	memset(s,0,sizeof(s));
+	for (;;) {
+		p = path_prob(h,seq,s,T);
+		total += p;
+		acc->sig->data[s[0]] += p;
+		for (t = 0; t < T; t++) {
+			acc->eta->data[s[t]*HMM_M+seq[t]] += p;
+			if (t) acc->gam->data[s[t-1]*HMM_N+s[t]] += p;
+		}
+		for (t = 0; t < T && ++s[t] == HMM_N; t++) s[t] = 0;
+		if (t == T) return total;
+	}
+}
+static void agree_arr (char *what, long T, dArray want, dArray got, double tol) {
+	long i;
+	for (i = 0; i < want->size; i++)
+		if (fabs(want->data[i] - got->data[i]) > tol * (fabs(want->data[i]) + 1)) {
+			printf("FAIL %s T=%ld [%ld]: want %.17g, got %.17g\n",
+				what,T,i,want->data[i],got->data[i]);
+			failures++;
+		}
+}
+static void agree_ll (char *what, long T, double want, double got, double tol) {
+	if (fabs(want - got) <= tol * (fabs(want) + 1)) return;
+	printf("FAIL %s T=%ld: want %.17g, got %.17g\n",what,T,want,got);
+	failures++;
+}
+/* log P(seq) without scaling: alpha kept as logs */
+static double log_forward (HMM h, int *seq, long T) {
+	double a[HMM_N], b[HMM_N], c[HMM_N];
+	long t;
+	int i, j;
+	for (j = 0; j < HMM_N; j++) a[j] = log(h->sig->data[j] * h->eta->data[j*HMM_M+seq[0]]);
+	for (t = 1; t < T; t++) {
+		for (j = 0; j < HMM_N; j++) {
+			for (i = 0; i < HMM_N; i++) c[i] = a[i] + log(h->gam->data[i*HMM_N+j]);
+			b[j] = vec_logsumexp(c,HMM_N) + log(h->eta->data[j*HMM_M+seq[t]]);
+		}
+		memcpy(a,b,sizeof(a));
+	}
+	return vec_logsumexp(a,HMM_N);
+}
+static void check_hmm (void) {
+	static int seq[20000];
+	HMM h, want, got;
+	struct rng r;
+	double p, ll, prev;
+	long T, t;
+	int iter;
+	rng_seed(&r,91011);
+	h = random_hmm(&r);
+	want = hmm_new(HMM_N,HMM_M);
+	got = hmm_new(HMM_N,HMM_M);
+	for (T = 1; T <= 8; T++) {
+		for (t = 0; t < T; t++) seq[t] = (int)rng_below(&r,HMM_M);
+		hmm_zero(want);
+		hmm_zero(got);
+		p = brute_force(h,seq,T,want);
+		dScale(want->sig,1/p);
+		dScale(want->gam,1/p);
+		dScale(want->eta,1/p);
+		ll = hmm_estep(h,seq,T,got);
+		agree_ll("hmm_estep loglik",T,log(p),ll,1e-12);
+		agree_arr("hmm_estep sig counts",T,want->sig,got->sig,1e-12);
+		agree_arr("hmm_estep gam counts",T,want->gam,got->gam,1e-12);
+		agree_arr("hmm_estep eta counts",T,want->eta,got->eta,1e-12);
+	}
+	T = sizeof(seq)/sizeof(*seq);
+	for (t = 0; t < T; t++) seq[t] = (int)rng_below(&r,HMM_M);
+	hmm_zero(got);
+	ll = hmm_estep(h,seq,T,got);
+	agree_ll("hmm_estep long loglik",T,log_forward(h,seq,T),ll,1e-10);
+	agree_ll("hmm_estep sig total",T,1,dSum(got->sig),1e-10);
+	agree_ll("hmm_estep gam total",T,T-1,dSum(got->gam),1e-10);
+	agree_ll("hmm_estep eta total",T,T,dSum(got->eta),1e-10);
+	/* EM never lowers the likelihood */
+	for (prev = ll, iter = 0; iter < 5; iter++) {
+		hmm_mstep(h,got);
+		hmm_zero(got);
+		ll = hmm_estep(h,seq,T,got);
+		if (ll < prev - 1e-9 * fabs(prev)) {
+			printf("FAIL baum-welch iteration %d: loglik fell from %.17g to %.17g\n",iter,prev,ll);
+			failures++;
+		}
+		prev = ll;
+	}
+	hmm_free(h);
+	hmm_free(want);
+	hmm_free(got);
+}
+
+/* checkpointed Viterbi against the most likely path found by brute force
+ * (short sequences) and by the plain full-table algorithm (long ones,
+ * including lengths that don't split evenly into segments) */
+static double brute_best (HMM h, int *seq, long T, int *best) {
+	int s[16];
+	double p, top = -1;
+	long t;
+	memset(s,0,sizeof(s));
+	for (;;) {
+		if ((p = path_prob(h,seq,s,T)) > top) {
+			top = p;
+			memcpy(best,s,T*sizeof(int));
+		}
+		for (t = 0; t < T && ++s[t] == HMM_N; t++) s[t] = 0;
+		if (t == T) return log(top);
+	}
+}
+static double full_viterbi (HMM h, int *seq, long T, int *path) {
+	int *bp = my_malloci((size_t)T*HMM_N,"test backpointers"), i, j, s;
+	double d[HMM_N], e[HMM_N], c;
+	long t;
+	for (j = 0; j < HMM_N; j++) d[j] = log(h->sig->data[j] * h->eta->data[j*HMM_M+seq[0]]);
+	for (t = 1; t < T; t++) {
+		for (j = 0; j < HMM_N; j++) {
+			e[j] = -HUGE_VAL;
+			for (i = 0; i < HMM_N; i++)
+				if ((c = d[i] + log(h->gam->data[i*HMM_N+j])) > e[j]) {
+					e[j] = c;
+					bp[t*HMM_N+j] = i;
+				}
+			e[j] += log(h->eta->data[j*HMM_M+seq[t]]);
+		}
+		memcpy(d,e,sizeof(d));
+	}
+	for (s = 0, j = 1; j < HMM_N; j++) if (d[j] > d[s]) s = j;
+	c = d[s];
+	for (t = T-1; t >= 0; t--) {
+		path[t] = s;
+		if (t) s = bp[t*HMM_N+s];
+	}
+	my_free(bp);
+	return c;
+}
+static void agree_path (char *what, long T, int *want, int *got) {
+	long t;
+	for (t = 0; t < T; t++)
+		if (want[t] != got[t]) {
+			printf("FAIL %s T=%ld: paths differ first at %ld (%d vs %d)\n",
+				what,T,t,want[t],got[t]);
+			failures++;
+			return;
+		}
+}
+static void check_viterbi (void) {
+	static long lens[] = { 2, 3, 10, 99, 100, 101, 4097, 20000, 0 };
+	static int seq[20000], want[20000], got[20000];
+	struct rng r;
+	HMM h;
+	long T, t;
+	int k;
+	rng_seed(&r,121314);
+	h = random_hmm(&r);
+	for (T = 1; T <= 8; T++) {
+		for (t = 0; t < T; t++) seq[t] = (int)rng_below(&r,HMM_M);
+		agree_ll("hmm_viterbi logprob",T,brute_best(h,seq,T,want),hmm_viterbi(h,seq,T,got),1e-12);
+		agree_path("hmm_viterbi path",T,want,got);
+	}
+	for (k = 0; (T = lens[k]); k++) {
+		for (t = 0; t < T; t++) seq[t] = (int)rng_below(&r,HMM_M);
+		agree_ll("hmm_viterbi logprob",T,full_viterbi(h,seq,T,want),hmm_viterbi(h,seq,T,got),1e-10);
+		agree_path("hmm_viterbi path",T,want,got);
+	}
+	/* a symbol no state emits makes the sequence impossible */
+	h->eta->data[0*HMM_M+1] = h->eta->data[1*HMM_M+1] = h->eta->data[2*HMM_M+1] = 0;
+	hmm_prepare(h);
+	seq[0] = 0; seq[1] = 1; seq[2] = 0;
+	if (hmm_viterbi(h,seq,3,got) != -HUGE_VAL) {
+		printf("FAIL hmm_viterbi: impossible sequence has a path\n");
+		failures++;
+	}
+	hmm_free(h);
+}
+
+/* MPMC batches: partial pushes into a full queue, partial pops from a
+ * draining one, and wraparound, single-threaded so the order is known */
+static void check_mpmc_edges (void) {
+	MPMC q = mpmc_new(8);
+	char *in[16], *out[16];
+	long i, k;
+	for (i = 0; i < 16; i++) in[i] = (char *)(i + 1);
+	expect("mpmc cap",8,mpmc_cap(q));
+	expect("mpmc pop empty",0,mpmc_pop_n(q,out,4));
+	expect("mpmc push 0",0,mpmc_push_n(q,in,0));
+	expect("mpmc push over cap",8,mpmc_push_n(q,in,10));
+	expect("mpmc push full",0,mpmc_push_n(q,in+8,3));
+	expect("mpmc pop part",3,mpmc_pop_n(q,out,3));
+	for (i = 0; i < 3; i++) expect("mpmc pop order",i+1,(long)out[i]);
+	expect("mpmc push wrap",3,mpmc_push_n(q,in+8,5));
+	expect("mpmc len",8,mpmc_len(q));
+	k = mpmc_pop_n(q,out,16);
+	expect("mpmc pop rest",8,k);
+	for (i = 0; i < k; i++) expect("mpmc wrap order",i+4,(long)out[i]);
+	expect("mpmc pop drained",0,mpmc_pop_n(q,out,1));
+	mpmc_free(q);
+}
+
+/* p producers push PER_PRODUCER distinct values each in batches of 1..7,
+ * p consumers pop in batches of 1..9; every value has to come out once */
+#define PER_PRODUCER 200000
+struct mpmc_run {
+	MPMC q;
+	int p;
+	_Atomic long popped, sum;
+};
+struct mpmc_arg { struct mpmc_run *run; long id; };
+
+static void *_mpmc_producer (void *v) {
+	struct mpmc_arg *a = (struct mpmc_arg *)v;
+	char *batch[8];
+	long next = a->id * PER_PRODUCER + 1, end = next + PER_PRODUCER, n, k, i;
+	while (next < end) {
+		n = 1 + (next % 7);
+		if (n > end - next) n = end - next;
+		for (i = 0; i < n; i++) batch[i] = (char *)(next + i);
+		for (i = 0; i < n; i += k)
+			if (!(k = mpmc_push_n(a->run->q,batch+i,n-i))) sched_yield();
+		next += n;
+	}
+	return NULL;
+}
+static void *_mpmc_consumer (void *v) {
+	struct mpmc_arg *a = (struct mpmc_arg *)v;
+	struct mpmc_run *r = a->run;
+	long total = (long)r->p * PER_PRODUCER, sum = 0, k, i, n = 1 + a->id;
+	char *batch[9];
+	while (atomic_load(&r->popped) < total) {
+		n = n % 9 + 1;
+		if (!(k = mpmc_pop_n(r->q,batch,n))) { sched_yield(); continue; }
+		for (i = 0; i < k; i++) sum += (long)batch[i];
+		atomic_fetch_add(&r->popped,k);
+	}
+	atomic_fetch_add(&r->sum,sum);
+	return NULL;
+}
+static void check_mpmc_threads (int p) {
+	struct mpmc_run r;
+	struct mpmc_arg a[16];
+	pthread_t t[16];
+	long total = (long)p * PER_PRODUCER;
+	char what[32];
+	int i;
+	r.q = mpmc_new(16);
+	r.p = p;
+	atomic_init(&r.popped,0);
+	atomic_init(&r.sum,0);
+	for (i = 0; i < 2*p; i++) {
+		a[i].run = &r;
+		a[i].id = i % p;
+		pthread_create(&t[i],NULL,i < p ? _mpmc_producer : _mpmc_consumer,&a[i]);
+	}
+	for (i = 0; i < 2*p; i++) pthread_join(t[i],NULL);
+	sprintf(what,"mpmc/%d count",p);
+	expect(what,total,atomic_load(&r.popped));
+	sprintf(what,"mpmc/%d sum",p);
+	expect(what,total * (total + 1) / 2,atomic_load(&r.sum));
+	expect("mpmc left over",0,mpmc_len(r.q));
+	mpmc_free(r.q);
+}
+
+int main (void) {
+	int level, best;
+	initialize_globals();
+	best = vec_select(VEC_AUTO);
+	for (level = VEC_SCALAR + 1; level <= best; level++) check_kernels(level);
+	check_empty_rows();
+	check_fmt();
+	check_hmm();
+	check_viterbi();
+	check_mpmc_edges();
+	for (level = 1; level <= 8; level *= 2) check_mpmc_threads(level);
+	vec_select(VEC_AUTO);
+	printf("check: %d failure%s (kernels up to %s)\n",failures,failures==1?"":"s",level_name[best]);
+	return failures ? 1 : 0;
+}
@@ -8,6 +8,12 @@
 #include <time.h>
 #include <sys/time.h>
 #include <glob.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 /* AUTOMAKE is kind of fun. If it sees that this source file is newer 
  * than the executable called, it calls "make". The Makefile is set up 
@@ -51,10 +57,6 @@ void auto_remake (char **argv) {
 void auto_remake (char **argv) {}
 #endif
 
-#ifndef MYMALLOC
-#define MYMALLOC 0
-#endif
-
 /* TRY_TO_FREE wraps all 'free()' calls. I come from Perl, and I tend not 
  * to call it when I should. This is just an easy way for me to disable 
  * my buggy free() calls.
@@ -75,23 +77,25 @@ int float_precision;
 double program_start;
 long seed, use_seed;
 int myc_debug_malloc;
+int myc_threads;
 
 double now (void);
 void default_file(char **filename, char *base, char *specific);
-inline int is (char *a, char *b) { return (a && b && !strcmp(a,b)) ? 1 : 0; }
+char *get_filename (char *spec);
+inline int is (char *a, char *b) { return (a && b && (a == b || !strcmp(a,b))) ? 1 : 0; }
+extern inline int is (char *a, char *b); /* so other files can link it */
 int is_in (char *target, char *potential, ...);
 void *my_malloc(size_t n, char *what);
 char *my_mallocc(size_t n, char *what);
 int *my_malloci(size_t n, char *what);
 double *my_mallocd(size_t n, char *what);
 
-typedef struct d_array {char *name; int ndim; int *dim; double *data;} *dArray;
-typedef struct i_array {char *name; int ndim; int *dim; int *data;} *iArray;
 typedef struct timeval tv;
 #define COUNT_T long long
 #define COUNT_GET(X) X##ll
 #define COUNT_FMT "%lld"
 #define TIME_T double
+#define COUNT_LINE 512
 struct counter {
 	char *display;
 	int mod; int wait;
@@ -105,6 +109,9 @@ struct counter {
 	int title;
 	int hms; int date;
 	int finish;
+	int tick; int every; double checked;
+	int threaded; struct _count_slot *slots, *extra;
+	pthread_t reporter; pthread_mutex_t lock; pthread_cond_t wake; int stop;
 };
 static int counters_OK;
 
@@ -112,8 +119,7 @@ typedef struct _fifo_node {
 	struct _fifo_node *next;
 	char *val;
 } *FIFOnode;
-typedef struct _fifo { FIFOnode nodes; FIFOnode after; } *FIFO;
-FIFO fifo_new(void);
+struct _fifo { FIFOnode nodes; FIFOnode after; };
 
 void without_counters (void(*func)(void)) {
 	int i = counters_OK;
@@ -136,6 +142,8 @@ static struct {
 	{ "out", 1, 1 },
 	{ NULL }
 };
+static HashMap _hm_new (size_t n, Arena a);
+static HashMap file_index; /* specific -> place in file_names, plus one */
 static FIFO output_files, mod_basenames, globs;
 static struct {
 	FIFO *fifo;
@@ -155,9 +163,13 @@ void initialize_globals (void) {
 	only_nonzero = 1; perturb = 0; randomize = 1;
 	seed = 618L; use_seed = 0;
 	myc_debug_malloc = 0;
-	for (i = 0; file_names[i].specific; i++)
+	myc_threads = 0;
+	if (!file_index) file_index = _hm_new(sizeof(file_names)/sizeof(file_names[0]),NULL);
+	for (i = 0; file_names[i].specific; i++) {
 		file_names[i].filename =
 			(char **)my_malloc(sizeof(char**),"filename pointer");
+		hm_puti(file_index,file_names[i].specific,i+1);
+	}
 }
 
 void warn (const char *fmt, ...) {
@@ -186,37 +198,218 @@ void die (const char *fmt, ...) {
 	exit(1);
 }
 
-#if MYMALLOC
-#define MEMORY 100000000
-static long long malloced;
-static char memory[MEMORY];
+/* ARENAS are bump allocators over mmap'd chunks. Allocation is a pointer
+ * bump, my_free of arena memory is a no-op, and the whole lot goes away
+ * with arena_reset (or back to a mark with arena_rollback). Chunks freed
+ * by a reset/rollback are kept for reuse rather than unmapped.
+ *
+ * use_arena() points my_malloc at an arena for the calling thread (NULL
+ * goes back to malloc). With MYMALLOC, init_malloc does that up front.
+ */
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK (1<<20)
+#endif
+#define ARENA_ALIGN 16
+#define ARENA_HDR 64
+
+typedef struct _arena_chunk {
+	struct _arena_chunk *prev;
+	size_t size; size_t used;
+} *ArenaChunk;
+struct arena {
+	ArenaChunk cur; ArenaChunk spare;
+	size_t chunk;
+};
+static __thread Arena cur_arena;
+
+/* every chunk mapped by any arena, sorted by address, so my_free can tell
+ * arena memory from malloc's with a binary search. Only mapping and
+ * unmapping chunks write it; n_chunks lets programs without arenas skip
+ * the lock altogether. */
+typedef struct { char *lo, *hi; } ChunkRange;
+static ChunkRange *chunk_ranges;
+static size_t chunk_cap;
+static atomic_size_t n_chunks;
+static pthread_rwlock_t chunk_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* index of the first range starting above p */
+static size_t _chunk_after (char *p) {
+	size_t lo = 0, hi = atomic_load_explicit(&n_chunks,memory_order_relaxed), mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (chunk_ranges[mid].lo <= p) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+static void _chunk_add (ArenaChunk c) {
+	size_t n, i;
+	pthread_rwlock_wrlock(&chunk_lock);
+	n = atomic_load_explicit(&n_chunks,memory_order_relaxed);
+	if (n == chunk_cap) {
+		chunk_cap = chunk_cap ? 2*chunk_cap : 64;
+		chunk_ranges = (ChunkRange *)realloc(chunk_ranges,chunk_cap*sizeof(ChunkRange));
+		if (!chunk_ranges) die("Couldn't track arena chunks\n");
+	}
+	i = _chunk_after((char *)c);
+	memmove(chunk_ranges+i+1,chunk_ranges+i,(n-i)*sizeof(ChunkRange));
+	chunk_ranges[i].lo = (char *)c;
+	chunk_ranges[i].hi = (char *)c + ARENA_HDR + c->size;
+	atomic_store_explicit(&n_chunks,n+1,memory_order_release);
+	pthread_rwlock_unlock(&chunk_lock);
+}
+static void _chunk_del (ArenaChunk c) {
+	size_t n, i;
+	pthread_rwlock_wrlock(&chunk_lock);
+	n = atomic_load_explicit(&n_chunks,memory_order_relaxed);
+	i = _chunk_after((char *)c);
+	if (i && chunk_ranges[i-1].lo == (char *)c) {
+		memmove(chunk_ranges+i-1,chunk_ranges+i,(n-i)*sizeof(ChunkRange));
+		atomic_store_explicit(&n_chunks,n-1,memory_order_release);
+	}
+	pthread_rwlock_unlock(&chunk_lock);
+}
+
+Arena arena_new (size_t chunk) {
+	Arena new = (Arena)malloc(sizeof(struct arena));
+	if (!new) die("Couldn't allocate arena\n");
+	new->cur = new->spare = NULL;
+	new->chunk = chunk ? chunk : ARENA_CHUNK;
+	return new;
+}
+
+static ArenaChunk _arena_grow (Arena a, size_t need) {
+	ArenaChunk c, *prev;
+	size_t len, page = sysconf(_SC_PAGESIZE);
+	for (prev = &a->spare; (c = *prev); prev = &c->prev)
+		if (c->size >= need) break;
+	if (c) {
+		*prev = c->prev;
+	} else {
+		len = ARENA_HDR + (need > a->chunk ? need : a->chunk);
+		len = (len + page - 1) / page * page;
+		c = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if (c == MAP_FAILED) die("Couldn't map %lu byte arena chunk\n",
+			(unsigned long)len);
+		c->size = len - ARENA_HDR;
+		_chunk_add(c);
+	}
+	c->used = 0;
+	c->prev = a->cur;
+	a->cur = c;
+	return c;
+}
+
+void *arena_alloc_aligned (Arena a, size_t n, size_t align) {
+	ArenaChunk c = a->cur;
+	char *base;
+	size_t off;
+	if (!align || (align & (align - 1)))
+		die("Arena alignment %lu isn't a power of two\n",(unsigned long)align);
+	/* so n + align, plus a header and a page of rounding, can't wrap */
+	if (n > (size_t)-1 / 4 || align > (size_t)-1 / 4)
+		die("Couldn't allocate %lu bytes aligned to %lu from an arena\n",
+			(unsigned long)n,(unsigned long)align);
+	if (c) {
+		base = (char *)c + ARENA_HDR;
+		off = (((size_t)base + c->used + align - 1) & ~(align - 1)) - (size_t)base;
+		if (off + n <= c->size) {
+			c->used = off + n;
+			return base + off;
+		}
+	}
+	c = _arena_grow(a,n + align);
+	base = (char *)c + ARENA_HDR;
+	off = (((size_t)base + align - 1) & ~(align - 1)) - (size_t)base;
+	c->used = off + n;
+	return base + off;
+}
+void *arena_alloc (Arena a, size_t n) {
+	return arena_alloc_aligned(a,n,ARENA_ALIGN);
+}
+
+ArenaMark arena_mark (Arena a) {
+	ArenaMark m;
+	m.chunk = a->cur;
+	m.used = a->cur ? a->cur->used : 0;
+	return m;
+}
+void arena_rollback (Arena a, ArenaMark m) {
+	ArenaChunk c;
+	while (a->cur && a->cur != m.chunk) {
+		c = a->cur;
+		a->cur = c->prev;
+		c->prev = a->spare;
+		a->spare = c;
+	}
+	if (a->cur) a->cur->used = m.used;
+}
+void arena_reset (Arena a) {
+	ArenaMark m = { NULL, 0 };
+	arena_rollback(a,m);
+}
+
+void arena_free (Arena a) {
+	ArenaChunk c;
+	if (!a) return;
+	arena_reset(a);
+	while ((c = a->spare)) {
+		a->spare = c->prev;
+		_chunk_del(c);
+		munmap(c,c->size + ARENA_HDR);
+	}
+	if (cur_arena == a) cur_arena = NULL;
+	free(a);
+}
+
+/* is p inside a chunk some arena has mapped? */
+static int _arena_owns (void *p) {
+	size_t i;
+	int r;
+	if (!atomic_load_explicit(&n_chunks,memory_order_acquire)) return 0;
+	pthread_rwlock_rdlock(&chunk_lock);
+	i = _chunk_after((char *)p);
+	r = i && (char *)p < chunk_ranges[i-1].hi;
+	pthread_rwlock_unlock(&chunk_lock);
+	return r;
+}
+
+Arena use_arena (Arena a) { Arena r = cur_arena; cur_arena = a; return r; }
+
+#ifndef MYMALLOC
+#define MYMALLOC 0
+#endif
+
 void init_malloc (void) {
 	static int inited = 0;
 	if (inited++) return;
-	malloced = 0;
-	memset(memory,0,MEMORY);
-}
-void *my_malloc (size_t n, char *what) {
-	void *where = memory+malloced;
-	if (myc_debug_malloc) warn("MYC-MYMALLOC(%d,%s)\n",n,what);
-	malloced+=n;
-	if (malloced > MEMORY)
-		die("MALLOCED TOO MUCH while mallocing %s\n",what);
-	return where;
+	if (MYMALLOC) use_arena(arena_new(0));
 }
-void my_free (void *tofree) { }
 
-#else
 #include <malloc.h>
+/* my_malloc without the memset, for callers that clear it themselves */
+static void *_my_malloc_raw (size_t n, char *what) {
+	void *new;
+	if (cur_arena) {
+		if (myc_debug_malloc) warn("MYC-MYMALLOC(%d,%s)\n",n,what);
+		new = arena_alloc(cur_arena,n);
+	} else {
+		new = malloc(n);
+		if (myc_debug_malloc) warn("MYC-MALLOC(%d,%s)\n",n,what);
+		if (!new) die("Couldn't allocate %s (%d byte%s)\n", what, n, n==1?"":"s");
+	}
+	return new;
+}
 void *my_malloc (size_t n, char *what) {
-	void *new = malloc(n);
-	if (myc_debug_malloc) warn("MYC-MALLOC(%d,%s)\n",n,what);
-	if (!new) die("Couldn't allocate %s (%d byte%s)\n", what, n, n==1?"":"s");
+	void *new = _my_malloc_raw(n,what);
 	memset(new,0,n);
 	return new;
 }
-void my_free (void *tofree) { if (TRY_TO_FREE) free(tofree); }
-#endif
+void my_free (void *tofree) {
+	if (!tofree || !TRY_TO_FREE) return;
+	if (_arena_owns(tofree)) return;
+	free(tofree);
+}
 
 int *my_malloci (size_t n, char *what) {
 	return (int *)my_malloc((n?n:1) * sizeof(int), what);
@@ -227,6 +420,124 @@ double *my_mallocd (size_t n, char *what) {
 char *my_mallocc (size_t n, char *what) {
 	return (char *)my_malloc((n?n:1) * sizeof(char), what);
 }
+/* POOLS hand out fixed-size objects from malloc'd slabs and keep freed
+ * ones on a free list, so churn (FIFO nodes, array headers, counters)
+ * never reaches malloc. pool_get doesn't zero. A pool_new pool belongs to
+ * one thread at a time; pool_new_shared ones take a lock, and that's what
+ * the library's own pools are, since nodes/headers/counters get made and
+ * freed from any thread. pool_malloc/pool_release sit on top with
+ * power-of-two size classes.
+ */
+#define POOL_SLAB 65536
+#define POOL_MIN 16
+#define POOL_CLASSES 5 // 16 .. 256 bytes
+
+typedef struct _pool_slab { struct _pool_slab *next; } *PoolSlab;
+struct pool {
+	size_t size;
+	char *what;
+	void *free;
+	PoolSlab slabs;
+	int shared;
+	pthread_mutex_t lock;
+};
+
+Pool pool_new (size_t size, char *what) {
+	Pool new = (Pool)malloc(sizeof(struct pool));
+	if (!new) die("Couldn't allocate pool for %s\n",what);
+	if (size < sizeof(void *)) size = sizeof(void *);
+	new->size = (size + POOL_MIN - 1) / POOL_MIN * POOL_MIN;
+	new->what = what;
+	new->free = NULL;
+	new->slabs = NULL;
+	new->shared = 0;
+	return new;
+}
+Pool pool_new_shared (size_t size, char *what) {
+	Pool new = pool_new(size,what);
+	new->shared = 1;
+	pthread_mutex_init(&new->lock,NULL);
+	return new;
+}
+/* *slot, made (once, whoever gets there first) as a shared pool */
+static pthread_mutex_t pool_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pool _shared_pool (Pool *slot, size_t size, char *what) {
+	Pool p = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+	if (p) return p;
+	pthread_mutex_lock(&pool_init_lock);
+	if (!(p = *slot)) {
+		p = pool_new_shared(size,what);
+		__atomic_store_n(slot,p,__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool_init_lock);
+	return p;
+}
+
+static void _pool_refill (Pool p) {
+	size_t hdr = (sizeof(struct _pool_slab) + POOL_MIN - 1) / POOL_MIN * POOL_MIN;
+	size_t n = (POOL_SLAB - hdr) / p->size;
+	PoolSlab slab;
+	char *obj;
+	if (n < 1) n = 1;
+	slab = (PoolSlab)malloc(hdr + n * p->size);
+	if (!slab) die("Couldn't allocate pool slab for %s\n",p->what);
+	if (myc_debug_malloc) warn("MYC-POOL(%d x %d,%s)\n",(int)n,(int)p->size,p->what);
+	slab->next = p->slabs;
+	p->slabs = slab;
+	for (obj = (char *)slab + hdr; n--; obj += p->size) {
+		*(void **)obj = p->free;
+		p->free = obj;
+	}
+}
+
+void *pool_get (Pool p) {
+	void *obj;
+	if (p->shared) pthread_mutex_lock(&p->lock);
+	if (!p->free) _pool_refill(p);
+	obj = p->free;
+	p->free = *(void **)obj;
+	if (p->shared) pthread_mutex_unlock(&p->lock);
+	return obj;
+}
+void pool_put (Pool p, void *obj) {
+	if (!obj) return;
+	if (p->shared) pthread_mutex_lock(&p->lock);
+	*(void **)obj = p->free;
+	p->free = obj;
+	if (p->shared) pthread_mutex_unlock(&p->lock);
+}
+void pool_free (Pool p) {
+	PoolSlab slab;
+	if (!p) return;
+	while ((slab = p->slabs)) {
+		p->slabs = slab->next;
+		free(slab);
+	}
+	if (p->shared) pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+static Pool size_classes[POOL_CLASSES];
+static int _size_class (size_t n) {
+	int c = 0;
+	size_t sz = POOL_MIN;
+	while (sz < n) { sz <<= 1; c++; }
+	return c;
+}
+void *pool_malloc (size_t n, char *what) {
+	int c = _size_class(n);
+	void *obj;
+	if (c >= POOL_CLASSES) return my_malloc(n,what);
+	obj = pool_get(_shared_pool(&size_classes[c],POOL_MIN << c,"size class"));
+	memset(obj,0,n);
+	return obj;
+}
+void pool_release (void *obj, size_t n) {
+	int c = _size_class(n);
+	if (c >= POOL_CLASSES) my_free(obj);
+	else pool_put(size_classes[c],obj);
+}
+
 char *my_strcpy (char *orig) {
 	char *new;
 	if (!orig) die("Copying empty string\n");
@@ -235,50 +546,747 @@ char *my_strcpy (char *orig) {
 	return new;
 }
 char *ltoa (long in) {
-	char *r = my_mallocc(16,"string");
-	sprintf(r,"%ld",in);
-	return r;
+	char r[24];
+	fmt_ll(r,in);
+	return my_strcpy(r);
 }
 char *lltoa (long long in) {
-	char *r = my_mallocc(40,"string");
-	sprintf(r,"%lld",in);
-	return r;
+	char r[24];
+	fmt_ll(r,in);
+	return my_strcpy(r);
 }
 int int_free (char *tmp) {
-	int r = atol(tmp);
+	int r = parse_ll(tmp,NULL);
 	my_free(tmp);
 	return r;
 }
 
+/* NUMBERS: locale-free formatting and parsing for text output.
+ * fmt_* write a NUL-terminated number into buf (FMT_MAX bytes is always
+ * enough) and return its length. fmt_fixed matches printf's "%.*f"
+ * exactly, up to FMT_PREC_MAX places (more is clamped, since DBL_MAX
+ * alone is 309 digits before the point); fmt_double is a string that reads back as the same double,
+ * and the shortest such in all but a sliver of cases (Grisu2).
+ * parse_ll/parse_d are atoll/strtod without the
+ * locale, handing the awkward cases (hex, inf, 20+ digits, big
+ * exponents) to strtod so results are always correctly rounded.
+ */
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+int fmt_ull (char *buf, unsigned long long v) {
+	char tmp[24], *p = tmp + sizeof(tmp);
+	int n;
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p,digit_pairs + 2*(v % 100),2);
+		v /= 100;
+	}
+	if (v >= 10) { p -= 2; memcpy(p,digit_pairs + 2*v,2); }
+	else *--p = '0' + v;
+	n = tmp + sizeof(tmp) - p;
+	memcpy(buf,p,n);
+	buf[n] = '\0';
+	return n;
+}
+int fmt_ll (char *buf, long long v) {
+	if (v >= 0) return fmt_ull(buf,v);
+	*buf = '-';
+	return 1 + fmt_ull(buf+1,-(unsigned long long)v);
+}
+
+static const double pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* a*10^prec is split exactly into sc + err (fma), so the round-half-even
+ * decision printf makes on the exact binary value can be made here too */
+int fmt_fixed (char *buf, double d, int prec) {
+	double a, sc, fl, t, err;
+	unsigned long long q, p10;
+	int n = 0, i;
+	char frac[24];
+	if (prec < 0) prec = 0;
+	if (prec > FMT_PREC_MAX) prec = FMT_PREC_MAX;
+	a = fabs(d);
+	if (prec > 17 || !(a * pow10_exact[prec] < 1125899906842624.0)) { // 2^50
+		n = snprintf(buf,FMT_MAX,"%.*f",prec,d);
+		return n < FMT_MAX ? n : FMT_MAX-1;
+	}
+	sc = a * pow10_exact[prec];
+	err = fma(a,pow10_exact[prec],-sc);
+	fl = floor(sc);
+	t = (sc - fl) - 0.5 + err;
+	q = (unsigned long long)fl;
+	if (t > 0 || (t == 0 && (q & 1))) q++;
+	if (signbit(d)) buf[n++] = '-';
+	p10 = (unsigned long long)pow10_exact[prec];
+	n += fmt_ull(buf+n,q / p10);
+	if (prec) {
+		buf[n++] = '.';
+		i = fmt_ull(frac,q % p10);
+		memset(buf+n,'0',prec-i);
+		memcpy(buf+n+prec-i,frac,i);
+		n += prec;
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+/* Grisu2, after Florian Loitsch's paper and Milo Yip's dtoa */
+typedef struct { unsigned long long f; int e; } diyfp;
+static const unsigned long long cached_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+	0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+	0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+	0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+	0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+	0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+	0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+	0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+	0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+	0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+	0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+	0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+	0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+	0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+	0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+	0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+	0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+	0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+	0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+	0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+	0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+	0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+static const short cached_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static diyfp _dfp_mul (diyfp x, diyfp y) {
+	const unsigned long long M32 = 0xFFFFFFFFULL;
+	unsigned long long a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+	unsigned long long ac = a*c, bc = b*c, ad = a*d, bd = b*d;
+	unsigned long long tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+	diyfp r;
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+static void _grisu_round (char *buf, int len, unsigned long long delta,
+		unsigned long long rest, unsigned long long ten_kappa,
+		unsigned long long wp_w) {
+	while (rest < wp_w && delta - rest >= ten_kappa
+		&& (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len-1]--;
+		rest += ten_kappa;
+	}
+}
+
+static const unsigned long long pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static void _grisu_digits (diyfp w, diyfp mp, unsigned long long delta,
+		char *buf, int *len, int *k) {
+	diyfp one;
+	unsigned long long wp_w = mp.f - w.f, p2, tmp;
+	unsigned p1, d;
+	int kappa = 1;
+	one.f = 1ULL << -mp.e;
+	one.e = mp.e;
+	p1 = (unsigned)(mp.f >> -one.e);
+	p2 = mp.f & (one.f - 1);
+	while (kappa < 10 && p1 >= pow10_u64[kappa]) kappa++;
+	*len = 0;
+	while (kappa > 0) {
+		d = p1 / pow10_u64[kappa-1];
+		p1 %= pow10_u64[kappa-1];
+		if (d || *len) buf[(*len)++] = '0' + d;
+		kappa--;
+		tmp = ((unsigned long long)p1 << -one.e) + p2;
+		if (tmp <= delta) {
+			*k += kappa;
+			_grisu_round(buf,*len,delta,tmp,pow10_u64[kappa] << -one.e,wp_w);
+			return;
+		}
+	}
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		d = (unsigned)(p2 >> -one.e);
+		if (d || *len) buf[(*len)++] = '0' + d;
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			_grisu_round(buf,*len,delta,p2,one.f,wp_w * pow10_u64[-kappa]);
+			return;
+		}
+	}
+}
+
+static void _grisu2 (double value, char *buf, int *len, int *k) {
+	union { double d; unsigned long long u; } u;
+	diyfp v, pl, mi, c, w, wp, wm;
+	double dk;
+	int ck, idx;
+	u.d = value;
+	v.f = u.u & 0x000FFFFFFFFFFFFFULL;
+	v.e = (int)((u.u >> 52) & 0x7FF);
+	if (v.e) { v.f += 1ULL << 52; v.e -= 1075; }
+	else v.e = -1074;
+	/* boundaries m+ and m- (normalized, sharing m+'s exponent) */
+	pl.f = (v.f << 1) + 1;
+	pl.e = v.e - 1;
+	while (!(pl.f & (1ULL << 53))) { pl.f <<= 1; pl.e--; }
+	pl.f <<= 10;
+	pl.e -= 10;
+	if (v.f == 1ULL << 52) { mi.f = (v.f << 2) - 1; mi.e = v.e - 2; }
+	else { mi.f = (v.f << 1) - 1; mi.e = v.e - 1; }
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+	/* cached power of ten that brings m+ into range */
+	dk = (-61 - pl.e) * 0.30102999566398114 + 347;
+	ck = (int)dk;
+	if (dk - ck > 0.0) ck++;
+	idx = (ck >> 3) + 1;
+	*k = -(-348 + (idx << 3));
+	c.f = cached_f[idx];
+	c.e = cached_e[idx];
+	w = v;
+	while (!(w.f & (1ULL << 52))) { w.f <<= 1; w.e--; }
+	w.f <<= 11;
+	w.e -= 11;
+	w = _dfp_mul(w,c);
+	wp = _dfp_mul(pl,c);
+	wm = _dfp_mul(mi,c);
+	wm.f++;
+	wp.f--;
+	_grisu_digits(w,wp,wp.f - wm.f,buf,len,k);
+}
+
+int fmt_double (char *buf, double d) {
+	char digits[20];
+	int len, k, kk, n = 0, i;
+	if (isnan(d)) return fmt_fixed(buf,d,0);
+	if (signbit(d)) { buf[n++] = '-'; d = -d; }
+	if (isinf(d)) { memcpy(buf+n,"inf",4); return n + 3; }
+	if (d == 0) { memcpy(buf+n,"0",2); return n + 1; }
+	_grisu2(d,digits,&len,&k);
+	kk = len + k; // digits[0] is the 10^(kk-1) place
+	if (k >= 0 && kk <= 21) {
+		memcpy(buf+n,digits,len);
+		memset(buf+n+len,'0',k);
+		n += kk;
+	} else if (0 < kk && kk <= 21) {
+		memcpy(buf+n,digits,kk);
+		buf[n+kk] = '.';
+		memcpy(buf+n+kk+1,digits+kk,len-kk);
+		n += len + 1;
+	} else if (-6 < kk && kk <= 0) {
+		buf[n++] = '0';
+		buf[n++] = '.';
+		memset(buf+n,'0',-kk);
+		memcpy(buf+n-kk,digits,len);
+		n += len - kk;
+	} else {
+		buf[n++] = digits[0];
+		if (len > 1) {
+			buf[n++] = '.';
+			memcpy(buf+n,digits+1,len-1);
+			n += len - 1;
+		}
+		buf[n++] = 'e';
+		buf[n++] = kk - 1 < 0 ? '-' : '+';
+		i = kk - 1 < 0 ? 1 - kk : kk - 1;
+		if (i < 10) buf[n++] = '0';
+		n += fmt_ull(buf+n,i);
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+static int _isspace (char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+long long parse_ll (const char *s, char **end) {
+	unsigned long long v = 0;
+	int neg = 0;
+	while (_isspace(*s)) s++;
+	if (*s == '-' || *s == '+') neg = (*s++ == '-');
+	while (*s >= '0' && *s <= '9') v = v*10 + (*s++ - '0');
+	if (end) *end = (char *)s;
+	return neg ? -(long long)v : (long long)v;
+}
+
+/* Clinger's fast path: up to 19 significant digits, and exact when the
+ * mantissa fits in 53 bits and the power of ten is exact */
+double parse_d (const char *s, char **end) {
+	const char *p = s;
+	unsigned long long m = 0;
+	int neg = 0, digits = 0, e10 = 0, e = 0, eneg = 0;
+	double d;
+	while (_isspace(*p)) p++;
+	if (*p == '-' || *p == '+') neg = (*p++ == '-');
+	for (; *p >= '0' && *p <= '9'; p++, digits++) m = m*10 + (*p - '0');
+	if (*p == '.')
+		for (p++; *p >= '0' && *p <= '9'; p++, digits++, e10--)
+			m = m*10 + (*p - '0');
+	if (!digits || digits > 19) return strtod(s,end);
+	if (*p == 'e' || *p == 'E') {
+		const char *q = p + 1;
+		if (*q == '-' || *q == '+') eneg = (*q++ == '-');
+		if (*q >= '0' && *q <= '9') {
+			for (; *q >= '0' && *q <= '9' && e < 10000; q++) e = e*10 + (*q - '0');
+			if (*q >= '0' && *q <= '9') return strtod(s,end);
+			e10 += eneg ? -e : e;
+			p = q;
+		}
+	}
+	if ((*p == 'x' || *p == 'X') || m > (1ULL << 53) || e10 < -22 || e10 > 22)
+		return strtod(s,end);
+	d = (double)m;
+	d = e10 < 0 ? d / pow10_exact[-e10] : d * pow10_exact[e10];
+	if (end) *end = (char *)p;
+	return neg ? -d : d;
+}
+
+/* STRBUF is a growable string: appends are amortized O(1), sb_reset
+ * empties it without giving the memory back, and one made with
+ * sb_new_arena grows inside that arena instead of the heap. b->s is
+ * always NUL-terminated once anything has been appended.
+ */
+static void _sb_grow (StrBuf b, size_t need) {
+	size_t cap = b->cap ? b->cap : 64;
+	char *s;
+	if (b->len + need + 1 <= b->cap) return;
+	while (cap < b->len + need + 1) cap *= 2;
+	if (b->arena) {
+		s = (char *)arena_alloc(b->arena,cap);
+		if (b->len) memcpy(s,b->s,b->len + 1);
+	} else {
+		s = (char *)realloc(b->s,cap);
+		if (!s) die("Couldn't grow string to %lu bytes\n",(unsigned long)cap);
+	}
+	b->s = s;
+	b->cap = cap;
+}
+
+StrBuf sb_new (size_t cap) {
+	StrBuf new = (StrBuf)my_malloc(sizeof(struct strbuf),"string builder");
+	_sb_grow(new,cap);
+	new->s[0] = '\0';
+	return new;
+}
+StrBuf sb_new_arena (Arena a, size_t cap) {
+	StrBuf new = (StrBuf)arena_alloc(a,sizeof(struct strbuf));
+	memset(new,0,sizeof(struct strbuf));
+	new->arena = a;
+	_sb_grow(new,cap);
+	new->s[0] = '\0';
+	return new;
+}
+void sb_free (StrBuf b) {
+	if (!b || b->arena) return;
+	free(b->s);
+	my_free(b);
+}
+
+void sb_reset (StrBuf b) {
+	b->len = 0;
+	if (b->s) b->s[0] = '\0';
+}
+void sb_appendn (StrBuf b, const char *p, size_t n) {
+	_sb_grow(b,n);
+	memcpy(b->s+b->len,p,n);
+	b->len += n;
+	b->s[b->len] = '\0';
+}
+void sb_append (StrBuf b, const char *p) { sb_appendn(b,p,strlen(p)); }
+void sb_appendc (StrBuf b, char c) {
+	_sb_grow(b,1);
+	b->s[b->len++] = c;
+	b->s[b->len] = '\0';
+}
+void sb_vappendf (StrBuf b, const char *fmt, va_list s) {
+	va_list again;
+	int n;
+	_sb_grow(b,0);
+	va_copy(again,s);
+	n = vsnprintf(b->s+b->len,b->cap-b->len,fmt,s);
+	if (n < 0) die("Bad format string: %s\n",fmt);
+	if (b->len + n + 1 > b->cap) {
+		_sb_grow(b,n);
+		vsnprintf(b->s+b->len,b->cap-b->len,fmt,again);
+	}
+	va_end(again);
+	b->len += n;
+}
+void sb_appendf (StrBuf b, const char *fmt, ...) {
+	va_list s;
+	va_start(s,fmt);
+	sb_vappendf(b,fmt,s);
+	va_end(s);
+}
+
+/* exact-size my_malloc'd copy, so it can go to my_free like any other */
+char *sb_dup (StrBuf b) {
+	char *new = my_mallocc(b->len+1,"string");
+	if (b->len) memcpy(new,b->s,b->len);
+	return new;
+}
+
+/* scratch builder the library formats into before copying out */
+static __thread struct strbuf scratch;
+
 char *my_sprintf (const char *fmt, ...) {
-	char *new = my_mallocc(512,"string for my_sprintf");
 	va_list s;
+	sb_reset(&scratch);
 	va_start(s,fmt);
-	vsprintf(new,fmt,s);
+	sb_vappendf(&scratch,fmt,s);
 	va_end(s);
+	return sb_dup(&scratch);
+}
+
+/* STRING VIEWS: a pointer and a length into someone else's buffer, so
+ * predicates and tokenizers can hand back pieces of a string without
+ * copying it. Views aren't NUL-terminated; sv_dup makes a C string.
+ * The scans do 16 bytes at a time with SSE2. str_find reads from
+ * aligned blocks, which never cross a page, so it can run past the
+ * terminator the same way the libc string functions do.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SV_SSE2 1
+#endif
+
+StrView sv (char *s) {
+	StrView v;
+	if (!s) die("strlen(empty-string)\n");
+	v.s = s;
+	v.len = strlen(s);
+	return v;
+}
+StrView sv_n (char *s, size_t len) {
+	StrView v;
+	v.s = s;
+	v.len = len;
+	return v;
+}
+
+/* first c in s, or its terminating NUL (strchrnul) */
+char *str_find (char *s, int c) {
+#if SV_SSE2
+	__m128i want = _mm_set1_epi8((char)c), zero = _mm_setzero_si128(), x;
+	char *p = (char *)((size_t)s & ~(size_t)15);
+	unsigned m;
+	x = _mm_load_si128((__m128i *)p);
+	m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x,want),_mm_cmpeq_epi8(x,zero)));
+	m >>= s - p;
+	if (m) return s + __builtin_ctz(m);
+	for (;;) {
+		p += 16;
+		x = _mm_load_si128((__m128i *)p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x,want),_mm_cmpeq_epi8(x,zero)));
+		if (m) return p + __builtin_ctz(m);
+	}
+#else
+	while (*s && *s != (char)c) s++;
+	return s;
+#endif
+}
+/* index of the first c in v, or -1 */
+long sv_find (StrView v, int c) {
+	size_t i = 0;
+#if SV_SSE2
+	__m128i want = _mm_set1_epi8((char)c);
+	unsigned m;
+	for (; i + 16 <= v.len; i += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(v.s+i)),want));
+		if (m) return (long)(i + __builtin_ctz(m));
+	}
+#endif
+	for (; i < v.len; i++) if (v.s[i] == (char)c) return (long)i;
+	return -1;
+}
+int sv_is (StrView v, char *s) {
+	return s && !strncmp(v.s,s,v.len) && !s[v.len];
+}
+int sv_starts (StrView v, StrView with) {
+	return with.len <= v.len && !memcmp(v.s,with.s,with.len);
+}
+int sv_ends (StrView v, StrView with) {
+	return with.len <= v.len && !memcmp(v.s+(v.len-with.len),with.s,with.len);
+}
+/* the piece of *rest up to delim, moving *rest past it (strsep, no writes);
+ * the last piece runs to the end. Check rest->s for NULL to stop. */
+StrView sv_split (StrView *rest, int delim) {
+	StrView tok = *rest;
+	long i = sv_find(*rest,delim);
+	if (i < 0) {
+		rest->s = NULL;
+		rest->len = 0;
+		return tok;
+	}
+	tok.len = i;
+	rest->s += i+1;
+	rest->len -= i+1;
+	return tok;
+}
+/* key=value: 1 and both halves if there's an '=', else 0 and key = all of v */
+int sv_kv (StrView v, StrView *key, StrView *val) {
+	long i = sv_find(v,'=');
+	*key = v;
+	if (i < 0) return 0;
+	key->len = i;
+	if (val) *val = sv_n(v.s+i+1,v.len-i-1);
+	return 1;
+}
+/* the same straight off a C string, in one pass */
+int str_kv (char *s, StrView *key, StrView *val) {
+	char *eq;
+	if (!s) die("strlen(empty-string)\n");
+	eq = str_find(s,'=');
+	*key = sv_n(s,eq-s);
+	if (!*eq) return 0;
+	if (val) *val = sv(eq+1);
+	return 1;
+}
+/* s past prefix, or NULL if it doesn't start with it */
+char *str_after (char *s, char *prefix) {
+	if (!prefix) die("strlen(empty-string)\n");
+	for (; *prefix; s++, prefix++) if (*s != *prefix) return NULL;
+	return s;
+}
+char *sv_dup (StrView v) {
+	char *new = my_mallocc(v.len+1,"string");
+	memcpy(new,v.s,v.len);
 	return new;
 }
 
+/* the old C-string helpers; argval and get_optpart still hand back copies */
 char *argval (char *opt) {
-	int i, l;
+	char *eq;
 	if (!opt) die("strlen(empty-string)\n");
-	l = strlen(opt);
-	for (i = 0; i < l; i++) if (opt[i]=='=') break;
-	if (i==l) return NULL;
-	i++;
-	return my_strcpy(opt+i);
+	eq = str_find(opt,'=');
+	return *eq ? my_strcpy(eq+1) : NULL;
 }
 int starts_with (char *string, char *with) {
-	if (!with) die("strlen(empty-string)\n");
-	return strncmp(string,with,strlen(with)) ? 0 : 1;
+	return str_after(string,with) ? 1 : 0;
 }
 int ends_with (char *string, char *with) {
 	if (!string || !with) die("strlen(empty-string)\n");
-	int sl = strlen(string);
-	int wl = strlen(with);
-	if (wl > sl) return 0;
-	return strncmp(string+(sl-wl),with,wl) ? 0 : 1;
+	return sv_ends(sv(string),sv(with));
+}
+
+/* HASH MAPS: string keys to a pointer or a long, open addressing with
+ * linear probing. Probes only walk the slot hashes (4 bytes each, 16 to
+ * a cache line); the entries are looked at when a hash matches. Keys are
+ * copied, so callers can pass views or stack buffers. Deleting shifts the
+ * run back instead of leaving tombstones. A stored hash of 0 marks an
+ * empty slot, so real ones get the top bit.
+ *
+ * A map keeps all its memory wherever it was made: the arena that was
+ * current for hm_new, or the heap, whatever the caller has switched to
+ * since. The library's own maps (interning, file names) are always on
+ * the heap, since they outlive any arena.
+ */
+#define HM_FULL 0x80000000u
+struct hment { char *key; size_t len; HMVal v; };
+struct hashmap {
+	unsigned *hash;
+	struct hment *ent;
+	size_t cap, len;
+	Arena arena; /* NULL: the heap */
+};
+
+static unsigned _hm_hash (const char *s, size_t len) {
+	unsigned long long h = 0x9e3779b97f4a7c15ULL ^ len, w;
+	for (; len >= 8; s += 8, len -= 8) {
+		memcpy(&w,s,8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w,s,len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
+	return (unsigned)h | HM_FULL;
+}
+static void *_hm_mem (Arena a, size_t n, char *what) {
+	void *p;
+	if (a) return arena_alloc(a,n);
+	if (!(p = malloc(n))) die("Couldn't allocate %s (%lu bytes)\n",what,(unsigned long)n);
+	return p;
+}
+static void _hm_unmem (Arena a, void *p) { if (!a) free(p); }
+static void _hm_alloc (HashMap m, size_t cap) {
+	m->cap = cap;
+	m->hash = (unsigned *)_hm_mem(m->arena,cap*sizeof(unsigned),"hash map slots");
+	memset(m->hash,0,cap*sizeof(unsigned));
+	m->ent = (struct hment *)_hm_mem(m->arena,cap*sizeof(struct hment),"hash map entries");
+}
+static HashMap _hm_new (size_t n, Arena a) {
+	HashMap new = (HashMap)_hm_mem(a,sizeof(struct hashmap),"hash map");
+	size_t cap = 16;
+	while (cap*3 < n*4) cap *= 2;
+	new->arena = a;
+	new->len = 0;
+	_hm_alloc(new,cap);
+	return new;
+}
+HashMap hm_new (size_t n) { return _hm_new(n,cur_arena); }
+void hm_free (HashMap m) {
+	size_t i;
+	if (!m) return;
+	if (!m->arena)
+		for (i = 0; i < m->cap; i++) if (m->hash[i]) free(m->ent[i].key);
+	_hm_unmem(m->arena,m->hash);
+	_hm_unmem(m->arena,m->ent);
+	_hm_unmem(m->arena,m);
+}
+size_t hm_len (HashMap m) { return m->len; }
+
+static void _hm_grow (HashMap m) {
+	unsigned *hash = m->hash;
+	struct hment *ent = m->ent;
+	size_t cap = m->cap, i, j;
+	_hm_alloc(m,cap*2);
+	for (i = 0; i < cap; i++) {
+		if (!hash[i]) continue;
+		for (j = hash[i] & (m->cap-1); m->hash[j]; j = (j+1) & (m->cap-1));
+		m->hash[j] = hash[i];
+		m->ent[j] = ent[i];
+	}
+	_hm_unmem(m->arena,hash);
+	_hm_unmem(m->arena,ent);
+}
+/* the slot holding key, or the empty one it would go in */
+static size_t _hm_slot (HashMap m, const char *key, size_t len, unsigned h) {
+	size_t mask = m->cap-1, i;
+	for (i = h & mask; m->hash[i]; i = (i+1) & mask)
+		if (m->hash[i] == h && m->ent[i].len == len && !memcmp(m->ent[i].key,key,len))
+			break;
+	return i;
+}
+
+/* the value for key, or NULL if it isn't there */
+HMVal *hm_find (HashMap m, char *key, size_t len) {
+	size_t i = _hm_slot(m,key,len,_hm_hash(key,len));
+	return m->hash[i] ? &m->ent[i].v : NULL;
+}
+/* the slot for key, adding it with a zero value if it wasn't there */
+static size_t _hm_add (HashMap m, char *key, size_t len) {
+	unsigned h = _hm_hash(key,len);
+	size_t i = _hm_slot(m,key,len,h);
+	if (m->hash[i]) return i;
+	if ((m->len+1)*4 > m->cap*3) {
+		_hm_grow(m);
+		i = _hm_slot(m,key,len,h);
+	}
+	m->hash[i] = h;
+	m->ent[i].key = (char *)_hm_mem(m->arena,len+1,"hash map key");
+	memcpy(m->ent[i].key,key,len);
+	m->ent[i].key[len] = 0;
+	m->ent[i].len = len;
+	m->ent[i].v.i = 0;
+	m->len++;
+	return i;
+}
+/* the value for key, added as zero if it wasn't there */
+HMVal *hm_ref (HashMap m, char *key, size_t len) {
+	size_t i = _hm_add(m,key,len); /* may grow m->ent */
+	return &m->ent[i].v;
+}
+/* the map's own copy of key (good until it's deleted); NULL if it isn't there */
+char *hm_key (HashMap m, char *key, size_t len) {
+	size_t i = _hm_slot(m,key,len,_hm_hash(key,len));
+	return m->hash[i] ? m->ent[i].key : NULL;
+}
+int hm_del (HashMap m, char *key, size_t len) {
+	size_t mask = m->cap-1, i = _hm_slot(m,key,len,_hm_hash(key,len)), j, home;
+	if (!m->hash[i]) return 0;
+	_hm_unmem(m->arena,m->ent[i].key);
+	/* pull later members of the run back over the hole when their home allows */
+	for (j = (i+1) & mask; m->hash[j]; j = (j+1) & mask) {
+		home = m->hash[j] & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			m->hash[i] = m->hash[j];
+			m->ent[i] = m->ent[j];
+			i = j;
+		}
+	}
+	m->hash[i] = 0;
+	m->len--;
+	return 1;
+}
+/* walks the entries: for (it = 0; hm_next(m,&it,&k,&v); ) ... */
+int hm_next (HashMap m, size_t *it, char **key, HMVal **val) {
+	for (; *it < m->cap; (*it)++) {
+		if (!m->hash[*it]) continue;
+		if (key) *key = m->ent[*it].key;
+		if (val) *val = &m->ent[*it].v;
+		(*it)++;
+		return 1;
+	}
+	return 0;
+}
+
+void *hm_get (HashMap m, char *key) {
+	HMVal *v = hm_find(m,key,strlen(key));
+	return v ? v->p : NULL;
+}
+void hm_put (HashMap m, char *key, void *val) { hm_ref(m,key,strlen(key))->p = val; }
+long hm_geti (HashMap m, char *key, long missing) {
+	HMVal *v = hm_find(m,key,strlen(key));
+	return v ? v->i : missing;
+}
+void hm_puti (HashMap m, char *key, long val) { hm_ref(m,key,strlen(key))->i = val; }
+
+/* INTERNING: one canonical copy of each string, for the life of the
+ * program, so interned names can be compared with == (is() checks that
+ * before strcmp). Safe to call from any thread.
+ */
+static HashMap interned;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+char *intern_n (char *s, size_t len) {
+	size_t i;
+	char *r;
+	pthread_mutex_lock(&intern_lock);
+	if (!interned) interned = _hm_new(256,NULL);
+	i = _hm_add(interned,s,len);
+	r = interned->ent[i].key;
+	pthread_mutex_unlock(&intern_lock);
+	return r;
 }
+char *intern (char *s) {
+	if (!s) return NULL;
+	return intern_n(s,strlen(s));
+}
+char *sv_intern (StrView v) { return intern_n(v.s,v.len); }
 
 FIFO fifo_new (void) {
 	FIFO new = (FIFO)my_malloc(sizeof(struct _fifo),"FIFO");
@@ -293,8 +1301,10 @@ int fifo_len (FIFO fifo) {
 	return i;
 }
 
+static Pool fifo_nodes;
 FIFOnode fifo_new_node (void) {
-	FIFOnode new = my_malloc(sizeof(struct _fifo_node),"FIFO node");
+	FIFOnode new;
+	new = (FIFOnode)pool_get(_shared_pool(&fifo_nodes,sizeof(struct _fifo_node),"FIFO node"));
 	new->next = NULL;
 	new->val = NULL;
 	return new;
@@ -319,75 +1329,427 @@ char *fifo_pop (FIFO fifo) {
 	if (fifo->nodes) {
 		ret = fifo->nodes->val;
 		if ((tmp = fifo->nodes->next)) {
-			my_free(fifo->nodes);
+			pool_put(fifo_nodes,fifo->nodes);
 			fifo->nodes = tmp;
 		}
 	}
 	return ret;
 }
 
-iArray namei (char *name, iArray arr) { arr->name = name; return arr; }
+/* MPMC is a bounded lock-free multi-producer/multi-consumer ring of the
+ * same string pointers a FIFO holds (Vyukov's design: each cell carries a
+ * sequence number saying whose turn it is). Capacity rounds up to a power
+ * of two. Push/pop return 0 instead of blocking when full/empty, and the
+ * _n variants claim a run of cells with a single CAS.
+ */
+#define CACHELINE 64
+struct _mpmc_cell { _Atomic size_t seq; char *val; };
+struct mpmc {
+	struct _mpmc_cell *cells;
+	size_t mask;
+	_Atomic size_t enq __attribute__((aligned(CACHELINE)));
+	_Atomic size_t deq __attribute__((aligned(CACHELINE)));
+};
 
-iArray initiArray (int ndim, ...) {
-	iArray new;
-	va_list s;
-	int i = 0, d = 1;
-	new = (iArray)my_malloc(sizeof(struct i_array), "array");
-	new->name = NULL;
-	new->ndim = ndim;
-	new->dim = my_malloci(ndim,"dim array");
-	va_start(s,ndim);
-	while (i < ndim) d *= (new->dim[i++] = va_arg(s,int));
-	va_end(s);
-	new->data = my_malloci(d,"data array");
-	for (i = 0; i < d; i++) new->data[i]=0;
+MPMC mpmc_new (size_t cap) {
+	MPMC new;
+	size_t i, n = 2;
+	while (n < cap) n <<= 1;
+	if (posix_memalign((void **)&new,CACHELINE,sizeof(struct mpmc)))
+		die("Couldn't allocate MPMC queue\n");
+	new->cells = (struct _mpmc_cell *)my_malloc(n*sizeof(struct _mpmc_cell),
+		"MPMC cells");
+	new->mask = n - 1;
+	for (i = 0; i < n; i++) atomic_init(&new->cells[i].seq,i);
+	atomic_init(&new->enq,0);
+	atomic_init(&new->deq,0);
 	return new;
 }
-
-void free_iArr (iArray arr) {
-	if (!arr) return;
-	my_free(arr->data);
-	my_free(arr->dim);
-	my_free(arr);
-	arr = NULL;
+void mpmc_free (MPMC q) {
+	if (!q) return;
+	my_free(q->cells);
+	free(q);
 }
 
-int iGetSet (iArray arr, int set, va_list *s) {
-	int val, prev;
-	int d, j;
-	long off = 0;
-	for (j = 0; j < arr->ndim; j++) {
-		if (j) off *= arr->dim[j];
-		d = va_arg(*s,int);
-		off += d;
+/* claims up to n cells starting at *tail whose sequence is (pos + ready),
+ * i.e. free cells for producers (ready=0), full ones for consumers (1) */
+static long _mpmc_claim (MPMC q, _Atomic size_t *tail, long n, size_t ready,
+		size_t *start) {
+	size_t pos = atomic_load_explicit(tail,memory_order_relaxed), seq;
+	long k;
+	if (n <= 0) return 0;
+	for (;;) {
+		for (k = 0; k < n; k++) {
+			seq = atomic_load_explicit(&q->cells[(pos+k) & q->mask].seq,
+				memory_order_acquire);
+			if (seq != pos + k + ready) break;
+		}
+		if (!k) {
+			seq = atomic_load_explicit(&q->cells[pos & q->mask].seq,
+				memory_order_acquire);
+			if ((long)(seq - (pos + ready)) < 0) return 0;
+			pos = atomic_load_explicit(tail,memory_order_relaxed);
+			continue;
+		}
+		if (atomic_compare_exchange_weak_explicit(tail,&pos,pos+k,
+				memory_order_relaxed,memory_order_relaxed)) {
+			*start = pos;
+			return k;
+		}
 	}
-	val = set ? va_arg(*s,int) : arr->data[off];
-	prev = set ? arr->data[off] : val;
-	if (set) arr->data[off] = val;
-	va_end(*s);
-	return prev;
 }
 
-int iGet (iArray arr, ...) {
-	va_list s;
-	va_start(s,arr);
-	return iGetSet(arr,0,&s);
+long mpmc_push_n (MPMC q, char **vals, long n) {
+	size_t pos;
+	long i, k = _mpmc_claim(q,&q->enq,n,0,&pos);
+	for (i = 0; i < k; i++) {
+		struct _mpmc_cell *c = &q->cells[(pos+i) & q->mask];
+		c->val = vals[i];
+		atomic_store_explicit(&c->seq,pos+i+1,memory_order_release);
+	}
+	return k;
+}
+long mpmc_pop_n (MPMC q, char **dest, long n) {
+	size_t pos;
+	long i, k = _mpmc_claim(q,&q->deq,n,1,&pos);
+	for (i = 0; i < k; i++) {
+		struct _mpmc_cell *c = &q->cells[(pos+i) & q->mask];
+		dest[i] = c->val;
+		atomic_store_explicit(&c->seq,pos+i+q->mask+1,memory_order_release);
+	}
+	return k;
 }
+int mpmc_push (MPMC q, char *val) { return mpmc_push_n(q,&val,1); }
+int mpmc_pop (MPMC q, char **dest) { return mpmc_pop_n(q,dest,1); }
 
-int iSet (iArray arr, ...) {
-	va_list s;
-	va_start(s,arr);
-	return iGetSet(arr,1,&s);
+/* exact when quiet, a snapshot otherwise */
+long mpmc_len (MPMC q) {
+	size_t d = atomic_load_explicit(&q->deq,memory_order_relaxed);
+	size_t e = atomic_load_explicit(&q->enq,memory_order_relaxed);
+	return e > d ? (long)(e - d) : 0;
 }
+long mpmc_cap (MPMC q) { return q->mask + 1; }
 
-int iGetSetP (iArray arr, int set, int *dim, int val) {
-	int prev;
-	int i;
+/* TPOOL is a fixed set of threads that all run the same job: tpool_run
+ * calls fn(arg,id) once for each id in 0..n-1 (id 0 on the caller) and
+ * returns when they're all done. Workers sleep on a condvar in between.
+ * A tpool_run from inside a job runs its ids serially instead of
+ * deadlocking. myc_pool() is the shared one, myc_threads wide.
+ */
+struct tpool {
+	int n, started, busy, stop;
+	unsigned long gen;
+	void (*fn)(void *arg, int id);
+	void *arg;
+	pthread_t *threads;
+	pthread_mutex_t lock, run;
+	pthread_cond_t go, done;
+	struct tpool *next; /* myc_pool's list */
+};
+static __thread int in_pool;
+
+static void *_tpool_worker (void *v) {
+	TPool p = (TPool)v;
+	unsigned long seen = 0;
+	int id;
+	in_pool = 1;
+	pthread_mutex_lock(&p->lock);
+	id = ++p->started;
+	for (;;) {
+		while (p->gen == seen && !p->stop) pthread_cond_wait(&p->go,&p->lock);
+		if (p->stop) break;
+		seen = p->gen;
+		pthread_mutex_unlock(&p->lock);
+		p->fn(p->arg,id);
+		pthread_mutex_lock(&p->lock);
+		if (!--p->busy) pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* pools live outside my_malloc: the shared one is often first made from
+ * inside a caller's arena (initdArray -> par_zero), and outlives it */
+TPool tpool_new (int n) {
+	TPool new = (TPool)calloc(1,sizeof(struct tpool));
+	int i;
+	if (n < 1) n = 1;
+	if (!new || !(new->threads = (pthread_t *)calloc(n,sizeof(pthread_t))))
+		die("Couldn't allocate a pool of %d threads\n",n);
+	new->n = n;
+	pthread_mutex_init(&new->lock,NULL);
+	pthread_mutex_init(&new->run,NULL);
+	pthread_cond_init(&new->go,NULL);
+	pthread_cond_init(&new->done,NULL);
+	for (i = 1; i < n; i++)
+		if (pthread_create(&new->threads[i],NULL,_tpool_worker,new))
+			die("Couldn't start pool thread %d\n",i);
+	return new;
+}
+
+void tpool_run (TPool p, void (*fn)(void *arg, int id), void *arg) {
+	int id;
+	if (p->n == 1 || in_pool) {
+		for (id = 0; id < p->n; id++) fn(arg,id);
+		return;
+	}
+	pthread_mutex_lock(&p->run);
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->busy = p->n - 1;
+	p->gen++;
+	pthread_cond_broadcast(&p->go);
+	pthread_mutex_unlock(&p->lock);
+	in_pool = 1;
+	fn(arg,0);
+	in_pool = 0;
+	pthread_mutex_lock(&p->lock);
+	while (p->busy) pthread_cond_wait(&p->done,&p->lock);
+	pthread_mutex_unlock(&p->lock);
+	pthread_mutex_unlock(&p->run);
+}
+
+int tpool_size (TPool p) { return p->n; }
+
+void tpool_free (TPool p) {
+	int i;
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->go);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 1; i < p->n; i++) pthread_join(p->threads[i],NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_mutex_destroy(&p->run);
+	pthread_cond_destroy(&p->go);
+	pthread_cond_destroy(&p->done);
+	free(p->threads);
+	free(p);
+}
+
+/* myc_threads <= 0 means $MYC_THREADS, or else one per online CPU */
+int myc_nthreads (void) {
+	long n;
+	char *e;
+	if (myc_threads > 0) return myc_threads;
+	if ((e = getenv("MYC_THREADS")) && (n = parse_ll(e,NULL)) > 0) return (int)n;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+/* the shared pool for the current myc_nthreads(). Another thread may
+ * still be running jobs on a pool handed out before myc_threads changed,
+ * so those are kept (idle) and reused rather than freed. */
+TPool myc_pool (void) {
+	static TPool pools;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int n = myc_nthreads();
+	TPool p;
+	pthread_mutex_lock(&lock);
+	for (p = pools; p && p->n != n; p = p->next);
+	if (!p) {
+		p = tpool_new(n);
+		p->next = pools;
+		pools = p;
+	}
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+/* PARALLEL_FOR runs fn(arg,a,b) over [lo,hi) in chunks of grain on
+ * myc_pool(). Chunks always start at lo + k*grain, whatever the thread
+ * count, so per-chunk results (partial sums, RNG streams) come out the
+ * same on any machine. grain <= 0 picks one from the range alone (about
+ * PAR_DEFAULT_CHUNKS chunks), never from the thread count, so that holds
+ * for the default too. Each thread starts on its own contiguous block of
+ * chunks and then steals leftover chunks from the others' blocks. With
+ * one thread, a small range, or from inside a pool job, the chunks just
+ * run in order on the caller.
+ */
+#define PAR_DEFAULT_CHUNKS 256
+struct _par_block {
+	_Atomic long next;
+	long end;
+	char pad[CACHELINE - sizeof(long) - sizeof(_Atomic long)];
+};
+struct _par_job {
+	long grain;
+	void (*fn)(void *arg, long a, long b);
+	void *arg;
+	int n;
+	struct _par_block *blk;
+	Counter c;
+	_Atomic long done;
+	long reported;
+};
+
+#ifndef PAR_MIN_BYTES
+#define PAR_MIN_BYTES (1<<20)
+#endif
+
+/* a threaded counter takes counts from anywhere; an ordinary one is only
+ * touched by the calling thread (id 0), which reports for everybody */
+static void _par_count (struct _par_job *j, int id, long n) {
+	long d;
+	if (!j->c) return;
+	if (j->c->threaded) { count_inc(j->c,n); return; }
+	atomic_fetch_add(&j->done,n);
+	if (id) return;
+	d = atomic_load(&j->done);
+	count_inc(j->c,d - j->reported);
+	j->reported = d;
+}
+
+static void _par_worker (void *v, int id) {
+	struct _par_job *j = (struct _par_job *)v;
+	struct _par_block *b;
+	long a, e;
+	int k;
+	for (k = 0; k < j->n; k++) {
+		b = &j->blk[(id + k) % j->n];
+		while ((a = atomic_fetch_add(&b->next,j->grain)) < b->end) {
+			e = (a + j->grain < b->end) ? a + j->grain : b->end;
+			j->fn(j->arg,a,e);
+			_par_count(j,id,e - a);
+		}
+	}
+}
+
+void parallel_for_count (long lo, long hi, long grain,
+		void (*fn)(void *arg, long a, long b), void *arg, Counter c) {
+	struct _par_job j;
+	TPool pool;
+	long per, a;
+	int n, t;
+	if (hi <= lo) return;
+	pool = myc_pool();
+	n = tpool_size(pool);
+	if (grain <= 0) grain = (hi - lo) / PAR_DEFAULT_CHUNKS;
+	if (grain < 1) grain = 1;
+	if (n == 1 || in_pool || hi - lo <= grain) {
+		for (a = lo; a < hi; a += grain) {
+			fn(arg,a,(a + grain < hi) ? a + grain : hi);
+			if (c) count_inc(c,((a + grain < hi) ? a + grain : hi) - a);
+		}
+		return;
+	}
+	j.grain = grain;
+	j.fn = fn;
+	j.arg = arg;
+	j.n = n;
+	j.c = c;
+	j.reported = 0;
+	atomic_init(&j.done,0);
+	j.blk = (struct _par_block *)my_malloc(n*sizeof(struct _par_block),"parallel_for blocks");
+	per = ((hi - lo + grain - 1) / grain + n - 1) / n * grain;
+	for (t = 0; t < n; t++) {
+		a = lo + t*per;
+		atomic_init(&j.blk[t].next,a < hi ? a : hi);
+		j.blk[t].end = (a + per < hi) ? a + per : hi;
+	}
+	tpool_run(pool,_par_worker,&j);
+	if (c && !c->threaded && j.done > j.reported) count_inc(c,j.done - j.reported);
+	my_free(j.blk);
+}
+void parallel_for (long lo, long hi, long grain,
+		void (*fn)(void *arg, long a, long b), void *arg) {
+	parallel_for_count(lo,hi,grain,fn,arg,NULL);
+}
+
+static void _par_zero_chunk (void *arg, long a, long b) {
+	memset((char *)arg + a,0,b - a);
+}
+/* memset(p,0,n), spread over the pool when it's big enough to matter
+ * (which also spreads first-touch page placement across the threads) */
+void par_zero (void *p, size_t n) {
+	if (n < PAR_MIN_BYTES) memset(p,0,n);
+	else parallel_for(0,n,PAR_MIN_BYTES,_par_zero_chunk,p);
+}
+
+iArray namei (char *name, iArray arr) { arr->name = name; return arr; }
+
+/* array headers are all the same size, so d and i arrays share a pool */
+static Pool array_headers;
+static void *_new_array_header (void) {
+	void *new;
+	new = pool_get(_shared_pool(&array_headers,sizeof(struct d_array) >
+		sizeof(struct i_array) ? sizeof(struct d_array) : sizeof(struct i_array),
+		"array"));
+	memset(new,0,sizeof(struct d_array));
+	return new;
+}
+
+/* row-major: stride[ndim-1] is 1, and arr->size is the element count */
+static long _init_strides (int ndim, int *dim, long **stride) {
+	long n = 1;
+	int i;
+	*stride = (long *)my_malloc((ndim?ndim:1)*sizeof(long),"stride array");
+	for (i = ndim - 1; i >= 0; i--) {
+		(*stride)[i] = n;
+		n *= dim[i];
+	}
+	return n;
+}
+
+iArray initiArray (int ndim, ...) {
+	iArray new;
+	va_list s;
+	int i = 0;
+	new = (iArray)_new_array_header();
+	new->name = NULL;
+	new->ndim = ndim;
+	new->dim = my_malloci(ndim,"dim array");
+	va_start(s,ndim);
+	while (i < ndim) new->dim[i++] = va_arg(s,int);
+	va_end(s);
+	new->size = _init_strides(ndim,new->dim,&new->stride);
+	new->data = (int *)_my_malloc_raw((new->size?new->size:1)*sizeof(int),"data array");
+	par_zero(new->data,(new->size?new->size:1)*sizeof(int));
+	return new;
+}
+
+void free_iArr (iArray arr) {
+	if (!arr) return;
+	if (arr->map) munmap(arr->map,arr->maplen);
+	else my_free(arr->data);
+	my_free(arr->dim);
+	my_free(arr->stride);
+	pool_put(array_headers,arr);
+	arr = NULL;
+}
+
+int iGetSet (iArray arr, int set, va_list *s) {
+	int val, prev;
+	int d, j;
 	long off = 0;
-	for (i = 0; i < arr->ndim; i++) {
-		if (i) off *= arr->dim[i];
-		off += dim[i];
+	for (j = 0; j < arr->ndim; j++) {
+		d = va_arg(*s,int);
+		off += d * arr->stride[j];
 	}
+	val = set ? va_arg(*s,int) : arr->data[off];
+	prev = set ? arr->data[off] : val;
+	if (set) arr->data[off] = val;
+	va_end(*s);
+	return prev;
+}
+
+int iGet (iArray arr, ...) {
+	va_list s;
+	va_start(s,arr);
+	return iGetSet(arr,0,&s);
+}
+
+int iSet (iArray arr, ...) {
+	va_list s;
+	va_start(s,arr);
+	return iGetSet(arr,1,&s);
+}
+
+int iGetSetP (iArray arr, int set, int *dim, int val) {
+	int prev;
+	int i;
+	long off = 0;
+	for (i = 0; i < arr->ndim; i++) off += dim[i] * arr->stride[i];
 	if (set) {
 		prev = arr->data[off];
 		arr->data[off] = val;
@@ -404,19 +1766,17 @@ dArray named (char *name, dArray arr) { arr->name = name; return arr; }
 dArray initdArray (int ndim, ...) {
 	dArray new;
 	va_list s;
-	int i = 0, d = 1, v;
-	new = (dArray)my_malloc(sizeof(struct d_array), "array");
+	int i = 0;
+	new = (dArray)_new_array_header();
 	new->name = NULL;
 	new->ndim = ndim;
 	new->dim = my_malloci(ndim,"dim array");
 	va_start(s,ndim);
-	while (i < ndim) {
-		v = va_arg(s,int);
-		d *= (new->dim[i++] = v);
-	}
+	while (i < ndim) new->dim[i++] = va_arg(s,int);
 	va_end(s);
-	new->data = my_mallocd(d,"data array");
-	for (i = 0; i < d; i++) new->data[i]=0.0;
+	new->size = _init_strides(ndim,new->dim,&new->stride);
+	new->data = (double *)_my_malloc_raw((new->size?new->size:1)*sizeof(double),"data array");
+	par_zero(new->data,(new->size?new->size:1)*sizeof(double));
 	if (verbose > 1) {
 		warn("Created array of size");
 		for (i = 0; i < ndim; i++) warn("[%d]",new->dim[i]);
@@ -427,9 +1787,11 @@ dArray initdArray (int ndim, ...) {
 
 void free_dArr (dArray arr) {
 	if (!arr) return;
-	my_free(arr->data);
+	if (arr->map) munmap(arr->map,arr->maplen);
+	else my_free(arr->data);
 	my_free(arr->dim);
-	my_free(arr);
+	my_free(arr->stride);
+	pool_put(array_headers,arr);
 	arr = NULL;
 }
 
@@ -438,9 +1800,8 @@ double dGetSet (dArray arr, int set, va_list *s) {
 	int d, j;
 	long off = 0;
 	for (j = 0; j < arr->ndim; j++) {
-		if (j) off *= arr->dim[j];
 		d = va_arg(*s,int);
-		off += d;
+		off += d * arr->stride[j];
 	}
 	val = set ? va_arg(*s,double) : arr->data[off];
 	va_end(*s);
@@ -472,10 +1833,7 @@ double dGetSetP (dArray arr, int set, int *dim, double val) {
 	double prev;
 	int i;
 	long off = 0;
-	for (i = 0; i < arr->ndim; i++) {
-		if (i) off *= arr->dim[i];
-		off += dim[i];
-	}
+	for (i = 0; i < arr->ndim; i++) off += dim[i] * arr->stride[i];
 	if (set) {
 		prev = arr->data[off];
 		arr->data[off] = val;
@@ -487,6 +1845,262 @@ double dGetSetP (dArray arr, int set, int *dim, double val) {
 double dGetP (dArray arr, int *d) { return dGetSetP(arr,0,d,0.0); }
 double dSetP (dArray arr, int *d, double v) { return dGetSetP(arr,1,d,v); }
 
+/* pointer to the contiguous run left after fixing the first nfix indices
+ * (nfix = ndim-1 gives a row along the last axis) */
+double *dSliceP (dArray arr, int nfix, int *idx) {
+	long off = 0;
+	int i;
+	for (i = 0; i < nfix; i++) off += idx[i] * arr->stride[i];
+	return arr->data + off;
+}
+int *iSliceP (iArray arr, int nfix, int *idx) {
+	long off = 0;
+	int i;
+	for (i = 0; i < nfix; i++) off += idx[i] * arr->stride[i];
+	return arr->data + off;
+}
+
+/* SPARSE ARRAYS: for tables that are nearly all zeros. Only the nonzero
+ * entries are stored, as row-major offsets and values packed into off[]
+ * and val[] (n of them, in no particular order), so walking the nonzeros
+ * is a straight scan of two arrays:
+ *     for (i = 0; i < s->n; i++) ... s->off[i], s->val[i] ...
+ * sdCoords turns an offset back into indices. A linear-probing index on
+ * the offset finds entries for get/set/inc. Storing a zero, or an
+ * increment that lands on one, drops the entry (the last one is moved
+ * into its place, so don't set while walking).
+ */
+struct sd_slot { long off, pos; }; /* pos -1: empty */
+#define SD_MIN_SLOTS 16
+
+static inline size_t _sd_hash (sdArray s, long off) {
+	return (size_t)(((unsigned long long)off * 0x9e3779b97f4a7c15ULL) >> s->shift);
+}
+static size_t _sd_slot (sdArray s, long off) {
+	size_t i;
+	for (i = _sd_hash(s,off); s->slot[i].pos >= 0 && s->slot[i].off != off;
+		i = (i+1) & s->mask);
+	return i;
+}
+static void _sd_index (sdArray s, size_t nslots) {
+	long i;
+	size_t j;
+	my_free(s->slot);
+	s->slot = (struct sd_slot *)_my_malloc_raw(nslots*sizeof(struct sd_slot),"sparse index");
+	memset(s->slot,0xff,nslots*sizeof(struct sd_slot));
+	s->mask = nslots-1;
+	for (s->shift = 64; nslots > 1; nslots >>= 1) s->shift--;
+	for (i = 0; i < s->n; i++) {
+		j = _sd_slot(s,s->off[i]);
+		s->slot[j].off = s->off[i];
+		s->slot[j].pos = i;
+	}
+}
+static void _sd_reserve (sdArray s, long n) {
+	long *off;
+	double *val;
+	size_t nslots = s->mask+1;
+	if (n > s->cap) {
+		if (n < 2*s->cap) n = 2*s->cap;
+		off = (long *)_my_malloc_raw(n*sizeof(long),"sparse offsets");
+		val = (double *)_my_malloc_raw(n*sizeof(double),"sparse values");
+		if (s->n) {
+			memcpy(off,s->off,s->n*sizeof(long));
+			memcpy(val,s->val,s->n*sizeof(double));
+		}
+		my_free(s->off);
+		my_free(s->val);
+		s->off = off;
+		s->val = val;
+		s->cap = n;
+	}
+	while ((size_t)n*4 > nslots*3) nslots *= 2;
+	if (nslots != s->mask+1) _sd_index(s,nslots);
+}
+/* empties slot i, pulling later members of its run back as in hm_del */
+static void _sd_unslot (sdArray s, size_t i) {
+	size_t j, home;
+	for (j = (i+1) & s->mask; s->slot[j].pos >= 0; j = (j+1) & s->mask) {
+		home = _sd_hash(s,s->slot[j].off);
+		if (((j - home) & s->mask) >= ((j - i) & s->mask)) {
+			s->slot[i] = s->slot[j];
+			i = j;
+		}
+	}
+	s->slot[i].pos = -1;
+}
+
+sdArray initsdArray (int ndim, ...) {
+	sdArray new = (sdArray)my_malloc(sizeof(struct sd_array),"sparse array");
+	va_list s;
+	int i = 0;
+	new->ndim = ndim;
+	new->dim = my_malloci(ndim,"dim array");
+	va_start(s,ndim);
+	while (i < ndim) new->dim[i++] = va_arg(s,int);
+	va_end(s);
+	new->size = _init_strides(ndim,new->dim,&new->stride);
+	_sd_index(new,SD_MIN_SLOTS);
+	return new;
+}
+sdArray namesd (char *name, sdArray arr) { arr->name = name; return arr; }
+void free_sdArr (sdArray arr) {
+	if (!arr) return;
+	my_free(arr->off);
+	my_free(arr->val);
+	my_free(arr->slot);
+	my_free(arr->dim);
+	my_free(arr->stride);
+	my_free(arr);
+}
+/* drops every entry but keeps the space */
+void sdClear (sdArray arr) {
+	arr->n = 0;
+	memset(arr->slot,0xff,(arr->mask+1)*sizeof(struct sd_slot));
+}
+
+double sdGetOff (sdArray arr, long off) {
+	struct sd_slot *e = &arr->slot[_sd_slot(arr,off)];
+	return e->pos >= 0 ? arr->val[e->pos] : 0.0;
+}
+/* set = 1 stores v, set = 2 adds it; either way the old value comes back */
+static double _sd_update (sdArray arr, long off, int set, double v) {
+	size_t i = _sd_slot(arr,off);
+	long pos = arr->slot[i].pos, last;
+	double prev = pos >= 0 ? arr->val[pos] : 0.0;
+	if (set > 1) v += prev;
+	if (pos >= 0 && v != 0) {
+		arr->val[pos] = v;
+	} else if (pos >= 0) {
+		_sd_unslot(arr,i);
+		if (pos != (last = --arr->n)) {
+			arr->off[pos] = arr->off[last];
+			arr->val[pos] = arr->val[last];
+			arr->slot[_sd_slot(arr,arr->off[pos])].pos = pos;
+		}
+	} else if (v != 0) {
+		if (arr->n+1 > arr->cap || (size_t)(arr->n+1)*4 > (arr->mask+1)*3) {
+			_sd_reserve(arr,arr->n+1);
+			i = _sd_slot(arr,off);
+		}
+		arr->slot[i].off = off;
+		arr->slot[i].pos = arr->n;
+		arr->off[arr->n] = off;
+		arr->val[arr->n++] = v;
+	}
+	return prev;
+}
+double sdSetOff (sdArray arr, long off, double v) { return _sd_update(arr,off,1,v); }
+double sdIncOff (sdArray arr, long off, double v) { return _sd_update(arr,off,2,v); }
+
+static long _sd_offset (sdArray arr, va_list *s) {
+	long off = 0;
+	int j;
+	for (j = 0; j < arr->ndim; j++) off += va_arg(*s,int) * arr->stride[j];
+	return off;
+}
+double sdGet (sdArray arr, ...) {
+	va_list s;
+	long off;
+	va_start(s,arr);
+	off = _sd_offset(arr,&s);
+	va_end(s);
+	return sdGetOff(arr,off);
+}
+double sdSet (sdArray arr, ...) {
+	va_list s;
+	long off;
+	double v;
+	va_start(s,arr);
+	off = _sd_offset(arr,&s);
+	v = va_arg(s,double);
+	va_end(s);
+	return _sd_update(arr,off,1,v);
+}
+double sdInc (sdArray arr, ...) {
+	va_list s;
+	long off;
+	double v;
+	va_start(s,arr);
+	off = _sd_offset(arr,&s);
+	v = va_arg(s,double);
+	va_end(s);
+	return _sd_update(arr,off,2,v);
+}
+static long _sd_offsetP (sdArray arr, int *d) {
+	long off = 0;
+	int j;
+	for (j = 0; j < arr->ndim; j++) off += d[j] * arr->stride[j];
+	return off;
+}
+double sdGetP (sdArray arr, int *d) { return sdGetOff(arr,_sd_offsetP(arr,d)); }
+double sdSetP (sdArray arr, int *d, double v) { return _sd_update(arr,_sd_offsetP(arr,d),1,v); }
+double sdIncP (sdArray arr, int *d, double v) { return _sd_update(arr,_sd_offsetP(arr,d),2,v); }
+void sdCoords (sdArray arr, long off, int *d) {
+	int j;
+	for (j = 0; j < arr->ndim; j++) {
+		d[j] = (int)(off / arr->stride[j]);
+		off %= arr->stride[j];
+	}
+}
+
+struct _sd_pair { long off; double val; };
+static int _by_off (const void *a, const void *b) {
+	long x = ((const struct _sd_pair *)a)->off, y = ((const struct _sd_pair *)b)->off;
+	return (x > y) - (x < y);
+}
+/* puts the nonzeros in row-major order (COO), for output or merging */
+void sdSort (sdArray arr) {
+	struct _sd_pair *pair = (struct _sd_pair *)_my_malloc_raw(
+		(arr->n?arr->n:1)*sizeof(struct _sd_pair),"sparse sort");
+	long i;
+	for (i = 0; i < arr->n; i++) {
+		pair[i].off = arr->off[i];
+		pair[i].val = arr->val[i];
+	}
+	qsort(pair,arr->n,sizeof(struct _sd_pair),_by_off);
+	for (i = 0; i < arr->n; i++) {
+		arr->off[i] = pair[i].off;
+		arr->val[i] = pair[i].val;
+	}
+	my_free(pair);
+	_sd_index(arr,arr->mask+1);
+}
+
+/* the nonzeros of a dense array, already in row-major order */
+sdArray sparse_dArray (dArray arr) {
+	sdArray new = (sdArray)my_malloc(sizeof(struct sd_array),"sparse array");
+	long i, n = 0;
+	new->name = arr->name;
+	new->ndim = arr->ndim;
+	new->dim = my_malloci(arr->ndim,"dim array");
+	memcpy(new->dim,arr->dim,arr->ndim*sizeof(int));
+	new->size = _init_strides(new->ndim,new->dim,&new->stride);
+	for (i = 0; i < arr->size; i++) n += arr->data[i] != 0;
+	_sd_index(new,SD_MIN_SLOTS);
+	_sd_reserve(new,n ? n : 1);
+	for (i = 0; i < arr->size; i++) {
+		if (arr->data[i] == 0) continue;
+		new->off[new->n] = i;
+		new->val[new->n++] = arr->data[i];
+	}
+	_sd_index(new,new->mask+1);
+	return new;
+}
+dArray dense_sdArray (sdArray arr) {
+	dArray new = (dArray)_new_array_header();
+	long i;
+	new->name = arr->name;
+	new->ndim = arr->ndim;
+	new->dim = my_malloci(arr->ndim,"dim array");
+	memcpy(new->dim,arr->dim,arr->ndim*sizeof(int));
+	new->size = _init_strides(new->ndim,new->dim,&new->stride);
+	new->data = (double *)_my_malloc_raw((new->size?new->size:1)*sizeof(double),"data array");
+	par_zero(new->data,(new->size?new->size:1)*sizeof(double));
+	for (i = 0; i < arr->n; i++) new->data[arr->off[i]] = arr->val[i];
+	return new;
+}
+
 /*
 #define log0(X) log(X)//double log0 (double x) { return x ? log(x) : -inf; }
 char *log0i (double x) {
@@ -496,46 +2110,488 @@ char *log0i (double x) {
 	else r = "-inf";
 	return r;
 }
+*/
+
+/* VECTOR KERNELS over contiguous doubles (arr->data, dRow, dSliceP).
+ * Each kernel has scalar, SSE2 and AVX2+FMA versions; the best one the
+ * CPU has is picked on first use, or forced with vec_select(VEC_*).
+ * Sums are split across several accumulators, so results can differ from
+ * a plain left-to-right loop (and between levels) in the last few bits.
+ */
+struct _veckern {
+	double (*sum)(const double *x, long n);
+	void (*scale)(double *x, long n, double a);
+	void (*axpy)(double *y, const double *x, long n, double a);
+	double (*max)(const double *x, long n);
+	double (*dot)(const double *x, const double *y, long n);
+	double (*sumexp)(const double *x, long n, double sub);
+};
+
+static double _sum_scalar (const double *x, long n) {
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s0 += x[i]; s1 += x[i+1]; s2 += x[i+2]; s3 += x[i+3];
+	}
+	for (; i < n; i++) s0 += x[i];
+	return (s0 + s1) + (s2 + s3);
+}
+static void _scale_scalar (double *x, long n, double a) {
+	long i;
+	for (i = 0; i < n; i++) x[i] *= a;
+}
+static void _axpy_scalar (double *y, const double *x, long n, double a) {
+	long i;
+	for (i = 0; i < n; i++) y[i] += a * x[i];
+}
+static double _max_scalar (const double *x, long n) {
+	double m = -HUGE_VAL;
+	long i;
+	for (i = 0; i < n; i++) if (x[i] > m) m = x[i];
+	return m;
+}
+static double _dot_scalar (const double *x, const double *y, long n) {
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s0 += x[i]*y[i]; s1 += x[i+1]*y[i+1];
+		s2 += x[i+2]*y[i+2]; s3 += x[i+3]*y[i+3];
+	}
+	for (; i < n; i++) s0 += x[i]*y[i];
+	return (s0 + s1) + (s2 + s3);
+}
+static double _sumexp_scalar (const double *x, long n, double sub) {
+	double s = 0;
+	long i;
+	for (i = 0; i < n; i++) s += exp(x[i] - sub);
+	return s;
+}
+static struct _veckern vk_scalar = {
+	_sum_scalar, _scale_scalar, _axpy_scalar,
+	_max_scalar, _dot_scalar, _sumexp_scalar
+};
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define VEC_X86 1
 
+/* exp for the vector paths: x = k ln2 + r, |r| <= ln2/2, 2^k built in the
+ * exponent bits and e^r from its Taylor series through r^12 (< 1ulp).
+ * Inputs are clamped to +-708, so very negative x comes back ~1e-308
+ * rather than 0; log-sum-exp doesn't care.
+ */
+#define EXP_CLAMP 708.0
+#define EXP_LN2HI 6.93147180369123816490e-01
+#define EXP_LN2LO 1.90821492927058770002e-10
+#define EXP_POLY(P,MADD,SET,r) do { \
+	P = SET(1.0/479001600); \
+	P = MADD(P,r,SET(1.0/39916800)); \
+	P = MADD(P,r,SET(1.0/3628800)); \
+	P = MADD(P,r,SET(1.0/362880)); \
+	P = MADD(P,r,SET(1.0/40320)); \
+	P = MADD(P,r,SET(1.0/5040)); \
+	P = MADD(P,r,SET(1.0/720)); \
+	P = MADD(P,r,SET(1.0/120)); \
+	P = MADD(P,r,SET(1.0/24)); \
+	P = MADD(P,r,SET(1.0/6)); \
+	P = MADD(P,r,SET(0.5)); \
+	P = MADD(P,r,SET(1.0)); \
+	P = MADD(P,r,SET(1.0)); \
+} while (0)
+
+__attribute__((target("sse2")))
+static double _hsum_sse2 (__m128d v) {
+	return _mm_cvtsd_f64(_mm_add_sd(v,_mm_unpackhi_pd(v,v)));
+}
+__attribute__((target("sse2")))
+static double _sum_sse2 (const double *x, long n) {
+	__m128d a0 = _mm_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+	double s;
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a0 = _mm_add_pd(a0,_mm_loadu_pd(x+i));
+		a1 = _mm_add_pd(a1,_mm_loadu_pd(x+i+2));
+		a2 = _mm_add_pd(a2,_mm_loadu_pd(x+i+4));
+		a3 = _mm_add_pd(a3,_mm_loadu_pd(x+i+6));
+	}
+	for (; i + 2 <= n; i += 2) a0 = _mm_add_pd(a0,_mm_loadu_pd(x+i));
+	s = _hsum_sse2(_mm_add_pd(_mm_add_pd(a0,a1),_mm_add_pd(a2,a3)));
+	for (; i < n; i++) s += x[i];
+	return s;
+}
+__attribute__((target("sse2")))
+static void _scale_sse2 (double *x, long n, double a) {
+	__m128d va = _mm_set1_pd(a);
+	long i = 0;
+	for (; i + 2 <= n; i += 2) _mm_storeu_pd(x+i,_mm_mul_pd(_mm_loadu_pd(x+i),va));
+	for (; i < n; i++) x[i] *= a;
+}
+__attribute__((target("sse2")))
+static void _axpy_sse2 (double *y, const double *x, long n, double a) {
+	__m128d va = _mm_set1_pd(a);
+	long i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(y+i,_mm_add_pd(_mm_loadu_pd(y+i),_mm_mul_pd(va,_mm_loadu_pd(x+i))));
+	for (; i < n; i++) y[i] += a * x[i];
+}
+__attribute__((target("sse2")))
+static double _max_sse2 (const double *x, long n) {
+	__m128d m0 = _mm_set1_pd(-HUGE_VAL), m1 = m0;
+	double m;
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		m0 = _mm_max_pd(m0,_mm_loadu_pd(x+i));
+		m1 = _mm_max_pd(m1,_mm_loadu_pd(x+i+2));
+	}
+	for (; i + 2 <= n; i += 2) m0 = _mm_max_pd(m0,_mm_loadu_pd(x+i));
+	m0 = _mm_max_pd(m0,m1);
+	m0 = _mm_max_sd(m0,_mm_unpackhi_pd(m0,m0));
+	m = _mm_cvtsd_f64(m0);
+	for (; i < n; i++) if (x[i] > m) m = x[i];
+	return m;
+}
+__attribute__((target("sse2")))
+static double _dot_sse2 (const double *x, const double *y, long n) {
+	__m128d a0 = _mm_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+	double s;
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a0 = _mm_add_pd(a0,_mm_mul_pd(_mm_loadu_pd(x+i),_mm_loadu_pd(y+i)));
+		a1 = _mm_add_pd(a1,_mm_mul_pd(_mm_loadu_pd(x+i+2),_mm_loadu_pd(y+i+2)));
+		a2 = _mm_add_pd(a2,_mm_mul_pd(_mm_loadu_pd(x+i+4),_mm_loadu_pd(y+i+4)));
+		a3 = _mm_add_pd(a3,_mm_mul_pd(_mm_loadu_pd(x+i+6),_mm_loadu_pd(y+i+6)));
+	}
+	for (; i + 2 <= n; i += 2)
+		a0 = _mm_add_pd(a0,_mm_mul_pd(_mm_loadu_pd(x+i),_mm_loadu_pd(y+i)));
+	s = _hsum_sse2(_mm_add_pd(_mm_add_pd(a0,a1),_mm_add_pd(a2,a3)));
+	for (; i < n; i++) s += x[i]*y[i];
+	return s;
+}
+__attribute__((target("sse2")))
+static __m128d _madd_sse2 (__m128d a, __m128d b, __m128d c) {
+	return _mm_add_pd(_mm_mul_pd(a,b),c);
+}
+__attribute__((target("sse2")))
+static __m128d _exp_sse2 (__m128d x) {
+	const __m128d round = _mm_set1_pd(6755399441055744.0); /* 1.5*2^52 */
+	__m128d k, r, p;
+	__m128i e;
+	x = _mm_min_pd(_mm_max_pd(x,_mm_set1_pd(-EXP_CLAMP)),_mm_set1_pd(EXP_CLAMP));
+	k = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(x,_mm_set1_pd(M_LOG2E)),round),round);
+	r = _mm_sub_pd(x,_mm_mul_pd(k,_mm_set1_pd(EXP_LN2HI)));
+	r = _mm_sub_pd(r,_mm_mul_pd(k,_mm_set1_pd(EXP_LN2LO)));
+	EXP_POLY(p,_madd_sse2,_mm_set1_pd,r);
+	e = _mm_add_epi32(_mm_cvtpd_epi32(k),_mm_set1_epi32(1023));
+	e = _mm_slli_epi64(_mm_unpacklo_epi32(e,_mm_setzero_si128()),52);
+	return _mm_mul_pd(p,_mm_castsi128_pd(e));
+}
+__attribute__((target("sse2")))
+static double _sumexp_sse2 (const double *x, long n, double sub) {
+	__m128d vs = _mm_set1_pd(sub), a = _mm_setzero_pd();
+	double s;
+	long i = 0;
+	for (; i + 2 <= n; i += 2)
+		a = _mm_add_pd(a,_exp_sse2(_mm_sub_pd(_mm_loadu_pd(x+i),vs)));
+	s = _hsum_sse2(a);
+	for (; i < n; i++) s += exp(x[i] - sub);
+	return s;
+}
+static struct _veckern vk_sse2 = {
+	_sum_sse2, _scale_sse2, _axpy_sse2,
+	_max_sse2, _dot_sse2, _sumexp_sse2
+};
+
+#define AVX2 __attribute__((target("avx2,fma")))
+AVX2 static double _hsum_avx2 (__m256d v) {
+	__m128d lo = _mm_add_pd(_mm256_castpd256_pd128(v),_mm256_extractf128_pd(v,1));
+	return _mm_cvtsd_f64(_mm_add_sd(lo,_mm_unpackhi_pd(lo,lo)));
+}
+AVX2 static double _sum_avx2 (const double *x, long n) {
+	__m256d a0 = _mm256_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+	double s;
+	long i = 0;
+	for (; i + 16 <= n; i += 16) {
+		a0 = _mm256_add_pd(a0,_mm256_loadu_pd(x+i));
+		a1 = _mm256_add_pd(a1,_mm256_loadu_pd(x+i+4));
+		a2 = _mm256_add_pd(a2,_mm256_loadu_pd(x+i+8));
+		a3 = _mm256_add_pd(a3,_mm256_loadu_pd(x+i+12));
+	}
+	for (; i + 4 <= n; i += 4) a0 = _mm256_add_pd(a0,_mm256_loadu_pd(x+i));
+	s = _hsum_avx2(_mm256_add_pd(_mm256_add_pd(a0,a1),_mm256_add_pd(a2,a3)));
+	for (; i < n; i++) s += x[i];
+	return s;
+}
+AVX2 static void _scale_avx2 (double *x, long n, double a) {
+	__m256d va = _mm256_set1_pd(a);
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_pd(x+i,_mm256_mul_pd(_mm256_loadu_pd(x+i),va));
+		_mm256_storeu_pd(x+i+4,_mm256_mul_pd(_mm256_loadu_pd(x+i+4),va));
+	}
+	for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x+i,_mm256_mul_pd(_mm256_loadu_pd(x+i),va));
+	for (; i < n; i++) x[i] *= a;
+}
+AVX2 static void _axpy_avx2 (double *y, const double *x, long n, double a) {
+	__m256d va = _mm256_set1_pd(a);
+	long i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(y+i,_mm256_fmadd_pd(va,_mm256_loadu_pd(x+i),_mm256_loadu_pd(y+i)));
+	for (; i < n; i++) y[i] += a * x[i];
+}
+AVX2 static double _max_avx2 (const double *x, long n) {
+	__m256d m0 = _mm256_set1_pd(-HUGE_VAL), m1 = m0;
+	__m128d h;
+	double m;
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		m0 = _mm256_max_pd(m0,_mm256_loadu_pd(x+i));
+		m1 = _mm256_max_pd(m1,_mm256_loadu_pd(x+i+4));
+	}
+	for (; i + 4 <= n; i += 4) m0 = _mm256_max_pd(m0,_mm256_loadu_pd(x+i));
+	m0 = _mm256_max_pd(m0,m1);
+	h = _mm_max_pd(_mm256_castpd256_pd128(m0),_mm256_extractf128_pd(m0,1));
+	h = _mm_max_sd(h,_mm_unpackhi_pd(h,h));
+	m = _mm_cvtsd_f64(h);
+	for (; i < n; i++) if (x[i] > m) m = x[i];
+	return m;
+}
+AVX2 static double _dot_avx2 (const double *x, const double *y, long n) {
+	__m256d a0 = _mm256_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+	double s;
+	long i = 0;
+	for (; i + 16 <= n; i += 16) {
+		a0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i),_mm256_loadu_pd(y+i),a0);
+		a1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+4),_mm256_loadu_pd(y+i+4),a1);
+		a2 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+8),_mm256_loadu_pd(y+i+8),a2);
+		a3 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+12),_mm256_loadu_pd(y+i+12),a3);
+	}
+	for (; i + 4 <= n; i += 4)
+		a0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i),_mm256_loadu_pd(y+i),a0);
+	s = _hsum_avx2(_mm256_add_pd(_mm256_add_pd(a0,a1),_mm256_add_pd(a2,a3)));
+	for (; i < n; i++) s += x[i]*y[i];
+	return s;
+}
+AVX2 static __m256d _exp_avx2 (__m256d x) {
+	__m256d k, r, p;
+	__m256i e;
+	x = _mm256_min_pd(_mm256_max_pd(x,_mm256_set1_pd(-EXP_CLAMP)),_mm256_set1_pd(EXP_CLAMP));
+	k = _mm256_round_pd(_mm256_mul_pd(x,_mm256_set1_pd(M_LOG2E)),_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	r = _mm256_fnmadd_pd(k,_mm256_set1_pd(EXP_LN2HI),x);
+	r = _mm256_fnmadd_pd(k,_mm256_set1_pd(EXP_LN2LO),r);
+	EXP_POLY(p,_mm256_fmadd_pd,_mm256_set1_pd,r);
+	e = _mm256_cvtepi32_epi64(_mm_add_epi32(_mm256_cvtpd_epi32(k),_mm_set1_epi32(1023)));
+	return _mm256_mul_pd(p,_mm256_castsi256_pd(_mm256_slli_epi64(e,52)));
+}
+AVX2 static double _sumexp_avx2 (const double *x, long n, double sub) {
+	__m256d vs = _mm256_set1_pd(sub), a0 = _mm256_setzero_pd(), a1 = a0;
+	double s;
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a0 = _mm256_add_pd(a0,_exp_avx2(_mm256_sub_pd(_mm256_loadu_pd(x+i),vs)));
+		a1 = _mm256_add_pd(a1,_exp_avx2(_mm256_sub_pd(_mm256_loadu_pd(x+i+4),vs)));
+	}
+	for (; i + 4 <= n; i += 4)
+		a0 = _mm256_add_pd(a0,_exp_avx2(_mm256_sub_pd(_mm256_loadu_pd(x+i),vs)));
+	s = _hsum_avx2(_mm256_add_pd(a0,a1));
+	for (; i < n; i++) s += exp(x[i] - sub);
+	return s;
+}
+static struct _veckern vk_avx2 = {
+	_sum_avx2, _scale_avx2, _axpy_avx2,
+	_max_avx2, _dot_avx2, _sumexp_avx2
+};
+#endif
+
+static struct _veckern *vk;
+
+/* VEC_AUTO picks the best the CPU supports, capped by MYC_VEC=scalar|sse2
+ * if set; asking for more than the CPU has falls back. Returns the level
+ * now in use. */
+int vec_select (int level) {
+	char *e;
+	int best = VEC_SCALAR;
+#ifdef VEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) best = VEC_SSE2;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) best = VEC_AVX2;
+#endif
+	if (level < 0 && (e = getenv("MYC_VEC")))
+		level = is(e,"scalar") ? VEC_SCALAR : is(e,"sse2") ? VEC_SSE2 : best;
+	if (level < 0 || level > best) level = best;
+	switch (level) {
+#ifdef VEC_X86
+		case VEC_AVX2: vk = &vk_avx2; break;
+		case VEC_SSE2: vk = &vk_sse2; break;
+#endif
+		default: vk = &vk_scalar;
+	}
+	return level;
+}
+#define VK (vk ? vk : (vec_select(VEC_AUTO), vk))
+
+double vec_sum (const double *x, long n) { return VK->sum(x,n); }
+void vec_scale (double *x, long n, double a) { VK->scale(x,n,a); }
+void vec_axpy (double *y, const double *x, long n, double a) { VK->axpy(y,x,n,a); }
+double vec_max (const double *x, long n) { return VK->max(x,n); }
+double vec_dot (const double *x, const double *y, long n) { return VK->dot(x,y,n); }
+
+/* scales x to sum to 1 (left alone if the sum is 0); returns the sum */
+double vec_normalize (double *x, long n) {
+	double s = VK->sum(x,n);
+	if (s) VK->scale(x,n,1.0/s);
+	return s;
+}
+
+/* log(sum(exp(x))) without overflow; -inf for n == 0 */
+double vec_logsumexp (const double *x, long n) {
+	double m = VK->max(x,n);
+	if (isinf(m) || isnan(m)) return m;
+	return m + log(VK->sumexp(x,n,m));
+}
+
+static void _same_size (dArray a, dArray b, char *what) {
+	if (a->size != b->size) die("%s: size mismatch (%ld vs %ld)\n",what,a->size,b->size);
+}
+
+/* whole-array ops split into PAR_CHUNK-element chunks over the pool;
+ * reductions keep one partial per chunk and add them in chunk order, so
+ * the answer doesn't depend on the thread count */
+struct _darr_job { double *x, *y, a, *part; long len; double (*f)(double); int (*fi)(int); int *ix, ia; };
+static long _nchunks (long n) { return (n + PAR_CHUNK - 1) / PAR_CHUNK; }
+static double _sum_parts (double *part, long n) {
+	double s = 0;
+	long k;
+	for (k = 0; k < n; k++) s += part[k];
+	return s;
+}
+static void _dsum_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	j->part[a/PAR_CHUNK] = vec_sum(j->x+a,b-a);
+}
+static void _ddot_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	j->part[a/PAR_CHUNK] = vec_dot(j->x+a,j->y+a,b-a);
+}
+static void _dmax_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	j->part[a/PAR_CHUNK] = vec_max(j->x+a,b-a);
+}
+static void _dscale_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	vec_scale(j->x+a,b-a,j->a);
+}
+static void _daxpy_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	vec_axpy(j->y+a,j->x+a,b-a,j->a);
+}
+static void _dfill_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	for (; a < b; a++) j->x[a] = j->a;
+}
+static void _dmap_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	for (; a < b; a++) j->x[a] = j->f(j->x[a]);
+}
+static void _ifill_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	for (; a < b; a++) j->ix[a] = j->ia;
+}
+static void _imap_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	for (; a < b; a++) j->ix[a] = j->fi(j->ix[a]);
+}
+static void _dnorm_chunk (void *v, long a, long b) {
+	struct _darr_job *j = (struct _darr_job *)v;
+	for (; a < b; a++) vec_normalize(j->x+a*j->len,j->len);
+}
+
+static double _dreduce (double *x, double *y, long n,
+		void (*chunk)(void *, long, long), int max) {
+	struct _darr_job j;
+	double r;
+	long k, nc = _nchunks(n);
+	if (nc <= 1) return max ? vec_max(x,n) : y ? vec_dot(x,y,n) : vec_sum(x,n);
+	j.x = x;
+	j.y = y;
+	j.part = my_mallocd(nc,"partial results");
+	parallel_for(0,n,PAR_CHUNK,chunk,&j);
+	if (max) for (r = j.part[0], k = 1; k < nc; k++) { if (j.part[k] > r) r = j.part[k]; }
+	else r = _sum_parts(j.part,nc);
+	my_free(j.part);
+	return r;
+}
+double dSum (dArray arr) { return _dreduce(arr->data,NULL,arr->size,_dsum_chunk,0); }
+double dMax (dArray arr) { return _dreduce(arr->data,NULL,arr->size,_dmax_chunk,1); }
+double dDot (dArray x, dArray y) {
+	_same_size(x,y,"dDot");
+	return _dreduce(x->data,y->data,x->size,_ddot_chunk,0);
+}
+double dLogSumExp (dArray arr) { return vec_logsumexp(arr->data,arr->size); }
+void dScale (dArray arr, double a) {
+	struct _darr_job j;
+	j.x = arr->data;
+	j.a = a;
+	parallel_for(0,arr->size,PAR_CHUNK,_dscale_chunk,&j);
+}
+void dAxpy (dArray y, double a, dArray x) {
+	struct _darr_job j;
+	_same_size(y,x,"dAxpy");
+	j.x = x->data;
+	j.y = y->data;
+	j.a = a;
+	parallel_for(0,y->size,PAR_CHUNK,_daxpy_chunk,&j);
+}
+void dFill (dArray arr, double v) {
+	struct _darr_job j;
+	j.x = arr->data;
+	j.a = v;
+	parallel_for(0,arr->size,PAR_CHUNK,_dfill_chunk,&j);
+}
+/* arr[i] = f(arr[i]); f gets called from several threads at once */
+void dMap (dArray arr, double (*f)(double)) {
+	struct _darr_job j;
+	j.x = arr->data;
+	j.f = f;
+	parallel_for(0,arr->size,PAR_CHUNK,_dmap_chunk,&j);
+}
+void iFill (iArray arr, int v) {
+	struct _darr_job j;
+	j.ix = arr->data;
+	j.ia = v;
+	parallel_for(0,arr->size,PAR_CHUNK,_ifill_chunk,&j);
+}
+void iMap (iArray arr, int (*f)(int)) {
+	struct _darr_job j;
+	j.ix = arr->data;
+	j.fi = f;
+	parallel_for(0,arr->size,PAR_CHUNK,_imap_chunk,&j);
+}
+
+/* every run along the last axis sums to 1 (all-zero runs are left alone) */
+void dNormalizeLast (dArray arr) {
+	struct _darr_job j;
+	long rows;
+	j.len = arr->ndim ? arr->dim[arr->ndim-1] : 1;
+	if (!j.len) return;
+	j.x = arr->data;
+	rows = arr->size / j.len;
+	parallel_for(0,rows,PAR_CHUNK/j.len + 1,_dnorm_chunk,&j);
+}
+
+/* normalizes the run along the last axis picked by the first ndim-1
+ * indices; returns the log of its old sum */
 double normalizeBut1 (dArray arr, ...) {
-	// normalizes a subArray [all but 1 dimension specified]
-	int i, max, ndim;
-	double sum = 0;
-	ndim = arr->ndim;
-	max = arr->dim[ndim-1];
-	int *dims = my_malloci(ndim,"normalization dimensions");
+	int i, *dims;
+	double sum;
 	va_list s;
+	dims = my_malloci(arr->ndim,"normalization dimensions");
 	va_start(s,arr);
-	for (i = 0; i < ndim - 1; i++) dims[i] = va_arg(s,int);
+	for (i = 0; i < arr->ndim - 1; i++) dims[i] = va_arg(s,int);
 	va_end(s);
-	switch (ndim) {
-		case 3:
-			for (i = 0; i < max; i++) sum += dGet(arr,dims[0],dims[1],i);
-			if (sum) for (i = 0; i < max; i++) dSet(arr,dims[0],dims[1],i,dGet(arr,dims[0],dims[1],i)/sum);
-		break;
-		case 2:
-			for (i = 0; i < max; i++) sum += dGet(arr,dims[0],i);
-			if (sum) for (i = 0; i < max; i++) dSet(arr,dims[0],i,dGet(arr,dims[0],i)/sum);
-		break;
-		case 1:
-			for (i = 0; i < max; i++) sum += dGet(arr,i);
-			if (sum) for (i = 0; i < max; i++) dSet(arr,i,dGet(arr,i)/sum);
-		break;
-		default:
-			for (i = 0; i < max; i++) {
-				dims[ndim-1] = i;
-				sum += dGetP(arr,dims);
-			}
-			for (i = 0; i < max; i++) {
-				if (!sum) break;
-				dims[ndim-1] = i;
-				dSetP(arr,dims,dGetP(arr,dims)/sum);
-			}
-	}
+	sum = vec_normalize(dSliceP(arr,arr->ndim-1,dims),arr->dim[arr->ndim-1]);
 	my_free(dims);
-	return log0(sum);
+	return log(sum);
 }
-*/
 
 void _printArray (int isd, int toobig, void *arr);
 void printiArray (iArray arr) { _printArray(0,0,(void*)arr); }
@@ -547,7 +2603,7 @@ void _printArray (int isd, int toobig, void *arr) {
 	char *name;
 	int ndim, *dims;
 	int im = 1, jm = 1, km = 1;
-	long d = 1;
+	long d = 1, *stride, si = 0, sj = 0, sk = 0;
 	iArray ir = NULL;
 	dArray dr = NULL;
 	if (isd) dr = (dArray)arr;
@@ -556,14 +2612,18 @@ void _printArray (int isd, int toobig, void *arr) {
 	if (name && !quiet) printf("%s\n",name);
 	ndim = isd ? dr->ndim : ir->ndim;
 	dims = isd ? dr->dim : ir->dim;
+	stride = isd ? dr->stride : ir->stride;
 	for (i = 0; i < ndim; i++) if (dims[i]>TOOMANY) toobig = 1;
 	switch (ndim){//toobig?0:ndim) {
 		case 3:
 			km = dims[2];
+			sk = stride[2];
 		case 2:
 			jm = dims[1];
+			sj = stride[1];
 		case 1:
 			im = dims[0];
+			si = stride[0];
 			if (km>TOOMANY) km=TOOMANY;
 			if (jm>TOOMANY) jm=TOOMANY;
 			if (im>TOOMANY) im=TOOMANY;
@@ -576,14 +2636,14 @@ void _printArray (int isd, int toobig, void *arr) {
 							((k||i)&&!j)?"\n":"",
 							j?" ":"",
 							float_precision,
-							dGet(dr,i,j,k)
+							dr->data[i*si+j*sj+k*sk]
 						);
 						else
 						printf("%s%s%s%d",
 							(k&&!i&&!j)?"\n":"",
 							((k||i)&&!j)?"\n":"",
 							j?" ":"",
-							iGet(ir,i,j,k)
+							ir->data[i*si+j*sj+k*sk]
 						);
 		break;
 		default:
@@ -648,13 +2708,14 @@ void _printNormArray (int toobig, dArray arr, dArray norm) {
 */
 
 
+static void _fd_forget (int fd);
 int _my_open (char *file, int flags, void(*warn_die)(const char *fmt,...)) {
 	int fd;
 	int reading = (flags && O_RDWR) ? 0 : 1;
 	char *desc = reading ? "reading" : "writing";
 	if (is(file,"-") && reading) fd = 0;
 	else if (is(file,"-") && !reading) fd = 1;
-	else fd = open(file,flags,0666);
+	else if ((fd = open(file,flags,0666)) >= 0) _fd_forget(fd);
 	if (fd < 0) warn_die("Couldn't open %s for %s\n", file, desc);
 	if (verbose > 1) warnq("Opened %s for %s\n",file,desc);
 	return fd;
@@ -662,40 +2723,285 @@ int _my_open (char *file, int flags, void(*warn_die)(const char *fmt,...)) {
 int my_open (char *file) { return _my_open(file,O_RDONLY,die); }
 int my_open_warn (char *file) { return _my_open(file,O_RDONLY,warnq); }
 int my_openout (char *file) {return _my_open(file,O_RDWR|O_CREAT|O_TRUNC,die);}
-int my_select (int fd) { int r = selected_fd; selected_fd = fd; return r; }
 
-int readi (int fd, int *dest) {
-	int r = read(fd,dest,sizeof(int));
-	if (r != sizeof(int) && r) die("Couldn't read integer (Got %d)\n",r);
+/* WRITEBUF_SIZE = bytes of output held per fd before it goes to write(2)
+ * (my_bufsize changes it for one fd). The whole write* family goes through
+ * these buffers, so anything else writing to the same fd (dprintf, a raw
+ * write) has to my_flush() first. Buffers are flushed at exit, by
+ * my_close, and when my_select moves away. A write too big to buffer goes
+ * out in one writev along with whatever was already pending. Close with
+ * my_close: after a plain close() the buffered tail is lost (with a
+ * warning) instead of landing in whatever file reuses the number.
+ */
+#ifndef WRITEBUF_SIZE
+#define WRITEBUF_SIZE 65536
+#endif
+#define WRITEBUF_MIN (2*FMT_MAX) // the text printers format in place
+
+typedef struct _writebuf {
+	size_t fill; size_t size; char *buf;
+	dev_t dev; ino_t ino; /* the file it was made for */
+} *WriteBuf;
+static WriteBuf *writebufs;
+static int n_writebufs;
+
+static void _fd_id (int fd, dev_t *dev, ino_t *ino) {
+	struct stat st;
+	if (fstat(fd,&st)) { *dev = 0; *ino = 0; return; }
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+}
+/* an fd closed with plain close() can come back as a different file;
+ * what was buffered for the old one can't go anywhere, so it's dropped
+ * rather than written into the new one. 1 if that happened. */
+static int _writebuf_stale (int fd, WriteBuf b) {
+	dev_t dev;
+	ino_t ino;
+	_fd_id(fd,&dev,&ino);
+	if (dev == b->dev && ino == b->ino) return 0;
+	if (b->fill) warn("Dropped %lu bytes buffered for fd %d, which was closed without my_close\n",
+		(unsigned long)b->fill,fd);
+	b->fill = 0;
+	b->dev = dev;
+	b->ino = ino;
+	return 1;
+}
+
+static void _write_all (int fd, const char *p, size_t n) {
+	ssize_t r;
+	while (n) {
+		r = write(fd,p,n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) die("Couldn't write to fd %d (%lu bytes left)\n",fd,(unsigned long)n);
+		p += r;
+		n -= r;
+	}
+}
+
+/* pending bytes a[0..an) then p[0..n), as few syscalls as possible */
+static void _write_two (int fd, const char *a, size_t an, const char *p, size_t n) {
+	struct iovec iov[2];
+	ssize_t r;
+	while (an) {
+		iov[0].iov_base = (void *)a;
+		iov[0].iov_len = an;
+		iov[1].iov_base = (void *)p;
+		iov[1].iov_len = n;
+		r = writev(fd,iov,2);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) die("Couldn't write to fd %d (%lu bytes left)\n",fd,(unsigned long)(an+n));
+		if ((size_t)r < an) { a += r; an -= r; continue; }
+		p += r - an;
+		n -= r - an;
+		an = 0;
+	}
+	_write_all(fd,p,n);
+}
+
+void my_flush (int fd) {
+	WriteBuf b;
+	if (fd < 0 || fd >= n_writebufs || !(b = writebufs[fd]) || !b->fill) return;
+	if (_writebuf_stale(fd,b)) return;
+	_write_all(fd,b->buf,b->fill);
+	b->fill = 0;
+}
+void my_flush_all (void) {
+	int fd;
+	for (fd = 0; fd < n_writebufs; fd++) my_flush(fd);
+}
+
+/* grows one of the fd-indexed buffer tables so that fd fits */
+static void _fdtable_grow (void ***table, int *size, int fd) {
+	int n;
+	if (fd < *size) return;
+	for (n = *size ? *size : 16; n <= fd; n *= 2);
+	*table = (void **)realloc(*table,n*sizeof(void *));
+	if (!*table) die("Couldn't allocate buffer table for fd %d\n",fd);
+	memset(*table+*size,0,(n-*size)*sizeof(void *));
+	*size = n;
+}
+
+/* buffers live outside my_malloc: they outlast whatever the caller is
+ * allocating from, and there's no point zeroing 64k on every open */
+static WriteBuf _writebuf (int fd) {
+	if (fd < n_writebufs && writebufs[fd]) return writebufs[fd];
+	if (fd < 0) die("Writing to bad fd %d\n",fd);
+	if (!n_writebufs) atexit(my_flush_all);
+	_fdtable_grow((void ***)&writebufs,&n_writebufs,fd);
+	writebufs[fd] = (WriteBuf)malloc(sizeof(struct _writebuf));
+	if (!writebufs[fd] || !(writebufs[fd]->buf = (char *)malloc(WRITEBUF_SIZE)))
+		die("Couldn't allocate write buffer for fd %d\n",fd);
+	writebufs[fd]->fill = 0;
+	writebufs[fd]->size = WRITEBUF_SIZE;
+	_fd_id(fd,&writebufs[fd]->dev,&writebufs[fd]->ino);
+	return writebufs[fd];
+}
+
+void my_bufsize (int fd, size_t size) {
+	WriteBuf b = _writebuf(fd);
+	if (size < WRITEBUF_MIN) size = WRITEBUF_MIN;
+	if (size == b->size) return;
+	my_flush(fd);
+	if (!(b->buf = (char *)realloc(b->buf,size)))
+		die("Couldn't resize write buffer for fd %d\n",fd);
+	b->size = size;
+}
+
+/* the fd's buffer, with at least need bytes free after b->fill */
+static WriteBuf _writespace (int fd, size_t need) {
+	WriteBuf b = _writebuf(fd);
+	if (b->fill + need > b->size) my_flush(fd);
+	return b;
+}
+
+void _writebytes (int fd, const void *p, size_t n) {
+	WriteBuf b = _writebuf(fd);
+	if (b->fill + n > b->size) {
+		if (n >= b->size) {
+			_writebuf_stale(fd,b);
+			_write_two(fd,b->buf,b->fill,(const char *)p,n);
+			b->fill = 0;
+			return;
+		}
+		my_flush(fd);
+	}
+	memcpy(b->buf+b->fill,p,n);
+	b->fill += n;
+}
+void writebytes (const void *p, size_t n) { _writebytes(selected_fd,p,n); }
+
+/* READBUF_SIZE = bytes read ahead per fd. Same deal as the write side:
+ * once the read* family has touched an fd, don't read() or lseek() it
+ * behind its back. Short reads (pipes) are retried until EOF.
+ */
+#ifndef READBUF_SIZE
+#define READBUF_SIZE 65536
+#endif
+
+typedef struct _readbuf { size_t pos, fill; char buf[READBUF_SIZE]; } *ReadBuf;
+static ReadBuf *readbufs;
+static int n_readbufs;
+
+static ReadBuf _readbuf (int fd) {
+	if (fd < n_readbufs && readbufs[fd]) return readbufs[fd];
+	if (fd < 0) die("Reading from bad fd %d\n",fd);
+	_fdtable_grow((void ***)&readbufs,&n_readbufs,fd);
+	readbufs[fd] = (ReadBuf)malloc(sizeof(struct _readbuf));
+	if (!readbufs[fd]) die("Couldn't allocate read buffer for fd %d\n",fd);
+	readbufs[fd]->pos = readbufs[fd]->fill = 0;
+	return readbufs[fd];
+}
+
+static size_t _read_some (int fd, char *p, size_t n) {
+	ssize_t r;
+	while ((r = read(fd,p,n)) < 0)
+		if (errno != EINTR) die("Couldn't read from fd %d\n",fd);
 	return r;
 }
-int readl (int fd, long *dest) {
-	int r = read(fd,dest,sizeof(long));
-	if (r != sizeof(long) && r) die("Couldn't read long (Got %d)\n", r);
+
+/* reads up to n bytes, only coming up short at EOF */
+size_t _readbytes (int fd, void *dest, size_t n) {
+	ReadBuf b = _readbuf(fd);
+	char *p = (char *)dest;
+	size_t got = 0, have, r;
+	while (got < n) {
+		have = b->fill - b->pos;
+		if (have) {
+			if (have > n - got) have = n - got;
+			memcpy(p+got,b->buf+b->pos,have);
+			b->pos += have;
+			got += have;
+		} else if (n - got >= READBUF_SIZE) {
+			if (!(r = _read_some(fd,p+got,n-got))) break;
+			got += r;
+		} else {
+			b->pos = 0;
+			if (!(b->fill = _read_some(fd,b->buf,READBUF_SIZE))) break;
+		}
+	}
+	return got;
+}
+
+static int _readval (int fd, void *dest, size_t n, char *what) {
+	size_t r = _readbytes(fd,dest,n);
+	if (r != n && r) die("Couldn't read %s (Got %d)\n",what,(int)r);
 	return r;
 }
-int readll (int fd, long long *dest) {
-	int r = read(fd,dest,sizeof(long long));
-	if (r!=sizeof(long long) && r) die("Couldn't read long long (Got %d)\n", r);
+
+/* bulk reads: returns how many whole values came back (< n only at EOF) */
+static long _readarr (int fd, void *dest, long n, size_t size, char *what) {
+	size_t r = _readbytes(fd,dest,n*size);
+	if (r % size) die("Couldn't read %s (Got %d stray bytes)\n",what,(int)(r%size));
+	return r / size;
+}
+long readia (int fd, int *dest, long n) {
+	return _readarr(fd,dest,n,sizeof(int),"integers");
+}
+long readda (int fd, double *dest, long n) {
+	return _readarr(fd,dest,n,sizeof(double),"doubles");
+}
+
+/* throws away fd's buffers; _my_open calls this on every fd it gets, since
+ * a number the kernel hands back may have been close()d with data still
+ * buffered for the old file */
+static void _fd_forget (int fd) {
+	if (fd >= 0 && fd < n_writebufs && writebufs[fd]) {
+		if (writebufs[fd]->fill)
+			warn("Dropped %lu bytes buffered for fd %d, which was closed without my_close\n",
+				(unsigned long)writebufs[fd]->fill,fd);
+		free(writebufs[fd]->buf);
+		free(writebufs[fd]);
+		writebufs[fd] = NULL;
+	}
+	if (fd >= 0 && fd < n_readbufs && readbufs[fd]) {
+		free(readbufs[fd]);
+		readbufs[fd] = NULL;
+	}
+}
+int my_close (int fd) {
+	my_flush(fd);
+	_fd_forget(fd);
+	return close(fd);
+}
+
+int my_select (int fd) {
+	int r = selected_fd;
+	if (fd != r) {
+		my_flush(r);
+		if (fd >= 0 && fd < n_writebufs && writebufs[fd]) _writebuf_stale(fd,writebufs[fd]);
+	}
+	selected_fd = fd;
 	return r;
 }
-void _writei (int fd, int i) { write(fd,&i,sizeof(int)); }
+
+int readi (int fd, int *dest) {
+	return _readval(fd,dest,sizeof(int),"integer");
+}
+int readl (int fd, long *dest) {
+	return _readval(fd,dest,sizeof(long),"long");
+}
+int readll (int fd, long long *dest) {
+	return _readval(fd,dest,sizeof(long long),"long long");
+}
+void _writei (int fd, int i) { _writebytes(fd,&i,sizeof(int)); }
 void writei (int i) { _writei(selected_fd,i); }
-void _writel (int fd, long l) { write(fd,&l,sizeof(long)); }
+void _writel (int fd, long l) { _writebytes(fd,&l,sizeof(long)); }
 void writel (long l) { _writel(selected_fd,l); }
-void _writell (int fd, long long ll) { write(fd,&ll,sizeof(long long)); }
+void _writell (int fd, long long ll) { _writebytes(fd,&ll,sizeof(long long)); }
 void writell (long long ll) { _writell(selected_fd,ll); }
-void _writed (int fd, double d) { write(fd,&d,sizeof(double)); }
+void _writed (int fd, double d) { _writebytes(fd,&d,sizeof(double)); }
 void writed (double d) { _writed(selected_fd,d); }
-void _writes (int fd, char *s) { write(fd,s,strlen(s)); }
+void _writes (int fd, char *s) { _writebytes(fd,s,strlen(s)); }
 void writes (char *s) { _writes(selected_fd,s); }
-void _writeslen (int fd, char *s, int i) { _writei(fd,i); write(fd,s,i); }
+void _writeslen (int fd, char *s, int i) { _writei(fd,i); _writebytes(fd,s,i); }
 void writeslen (char *s) { _writeslen(selected_fd,s,strlen(s)); }
+void _writeia (int fd, int *a, long n) { _writebytes(fd,a,n*sizeof(int)); }
+void writeia (int *a, long n) { _writeia(selected_fd,a,n); }
+void _writeda (int fd, double *a, long n) { _writebytes(fd,a,n*sizeof(double)); }
+void writeda (double *a, long n) { _writeda(selected_fd,a,n); }
 
 int readd (int fd, double *dest) {
-	int r = read(fd,dest,sizeof(double));
-	if (r != sizeof(double) && r) die("Couldn't read double (Got %d)\n",r);
-	return r;
+	return _readval(fd,dest,sizeof(double),"double");
 }
 
 int readslen (int fd, char **dest) {
@@ -703,169 +3009,660 @@ int readslen (int fd, char **dest) {
 	int r = readi(fd,&i);
 	if (!r) return r;
 	(*dest) = my_mallocc(i+1,"string read");
-	r = read(fd,*dest,i);
+	r = _readbytes(fd,*dest,i);
 	if (r != i) die("Couldn't read full string (Expected %d, got %d)\n", i, r);
 	return r;
 }
 
-char *_get_filename (char *specific, int nodefault) {
-	int i;
-	for (i = 0; file_names[i].specific; i++)
-		if (is(specific,file_names[i].specific))
-			break;
-	if (!file_names[i].specific) return NULL;
-	if (!file_names[i].filename || !*file_names[i].filename) if (!nodefault)
-		default_file(file_names[i].filename,all_base,file_names[i].specific);
-	file_names[i].changed = 0;
-	return *file_names[i].filename;
+/* Array files (what save_dArray writes and map_dArray maps) are a small
+ * header followed by the raw row-major data:
+ *     "MYCA" <int element size> <int ndim> <int dim>[ndim]
+ * padded to ARRFILE_ALIGN bytes, so the data can be used in place.
+ */
+#define ARRFILE_ALIGN 64
+#define ARRFILE_MAGIC "MYCA"
+
+static size_t _arrfile_offset (int ndim) {
+	size_t hdr = 4 + (2 + (size_t)ndim) * sizeof(int);
+	return (hdr + ARRFILE_ALIGN - 1) / ARRFILE_ALIGN * ARRFILE_ALIGN;
+}
+
+static long _arr_elements (int ndim, int *dim) {
+	long n = 1;
+	int i;
+	for (i = 0; i < ndim; i++) n *= dim[i];
+	return n;
+}
+
+static void _save_array (char *file, char *name, int ndim, int *dim,
+		void *data, int elsize) {
+	static char pad[ARRFILE_ALIGN];
+	int fd = my_openout(file);
+	size_t hdr = 4 + (2 + (size_t)ndim) * sizeof(int);
+	_writebytes(fd,ARRFILE_MAGIC,4);
+	_writei(fd,elsize);
+	_writei(fd,ndim);
+	_writeia(fd,dim,ndim);
+	_writebytes(fd,pad,_arrfile_offset(ndim)-hdr);
+	_writebytes(fd,data,_arr_elements(ndim,dim)*elsize);
+	if (fd != 1) my_close(fd);
+	else my_flush(fd);
+	if (verbose > 1) warnq("Saved %s to %s\n",name?name:"array",file);
+}
+void save_dArray (dArray arr, char *file) {
+	_save_array(file,arr->name,arr->ndim,arr->dim,arr->data,sizeof(double));
+}
+void save_iArray (iArray arr, char *file) {
+	_save_array(file,arr->name,arr->ndim,arr->dim,arr->data,sizeof(int));
+}
+
+/* maps file, checks its header, and fills in everything but the name */
+static void _map_array (char *file, int mode, int elsize,
+		int *ndim, int **dim, void **data, void **map, size_t *maplen) {
+	struct stat st;
+	int fd, i, *hdr;
+	size_t off, n;
+	int prot = (mode == MAP_ARR_RO) ? PROT_READ : PROT_READ|PROT_WRITE;
+	int flags = (mode == MAP_ARR_PRIVATE) ? MAP_PRIVATE : MAP_SHARED;
+	if (is(file,"-")) die("Can't map stdin/stdout as an array\n");
+	fd = (mode == MAP_ARR_RW) ? _my_open(file,O_RDWR,die) : my_open(file);
+	if (fstat(fd,&st)) die("Couldn't stat %s\n",file);
+	if ((size_t)st.st_size < _arrfile_offset(0))
+		die("%s is too short to be an array file\n",file);
+	*maplen = st.st_size;
+	*map = mmap(NULL,*maplen,prot,flags,fd,0);
+	close(fd);
+	if (*map == MAP_FAILED) die("Couldn't map %s\n",file);
+	hdr = (int *)((char *)*map + 4);
+	if (memcmp(*map,ARRFILE_MAGIC,4)) die("%s isn't an array file\n",file);
+	if (hdr[0] != elsize)
+		die("%s holds %d-byte elements, not %d\n",file,hdr[0],elsize);
+	*ndim = hdr[1];
+	if (*ndim < 1 || (size_t)*ndim > *maplen / sizeof(int)
+			|| (off = _arrfile_offset(*ndim)) > *maplen)
+		die("%s has a bad header\n",file);
+	/* the dims come from the file: no negatives, and the product is
+	 * checked against what's there a step at a time, so it can't wrap */
+	*dim = my_malloci(*ndim,"dim array");
+	for (n = 1, i = 0; i < *ndim; i++) {
+		if (((*dim)[i] = hdr[2+i]) < 0)
+			die("%s has a negative dimension (%d)\n",file,(*dim)[i]);
+		if ((*dim)[i] && n > (*maplen - off) / elsize / (*dim)[i])
+			die("%s is truncated\n",file);
+		n *= (*dim)[i];
+	}
+	*data = (char *)*map + off;
+	if (verbose > 1) warnq("Mapped %s (%lu bytes)\n",file,(unsigned long)*maplen);
+}
+dArray map_dArray (char *file, int mode) {
+	dArray new = (dArray)_new_array_header();
+	_map_array(file,mode,sizeof(double),&new->ndim,&new->dim,
+		(void **)&new->data,&new->map,&new->maplen);
+	new->size = _init_strides(new->ndim,new->dim,&new->stride);
+	return new;
+}
+iArray map_iArray (char *file, int mode) {
+	iArray new = (iArray)_new_array_header();
+	_map_array(file,mode,sizeof(int),&new->ndim,&new->dim,
+		(void **)&new->data,&new->map,&new->maplen);
+	new->size = _init_strides(new->ndim,new->dim,&new->stride);
+	return new;
+}
+dArray map_dArray_spec (char *spec, int mode) {
+	return map_dArray(get_filename(spec),mode);
+}
+iArray map_iArray_spec (char *spec, int mode) {
+	return map_iArray(get_filename(spec),mode);
+}
+
+/* creates a zeroed array file of the given shape and maps it read-write */
+static void _create_mapped (char *file, int elsize, int ndim, va_list *s,
+		int **dim, void **data, void **map, size_t *maplen) {
+	int fd, i, *hdr;
+	size_t off = _arrfile_offset(ndim);
+	if (is(file,"-")) die("Can't map stdin/stdout as an array\n");
+	*dim = my_malloci(ndim,"dim array");
+	for (i = 0; i < ndim; i++) (*dim)[i] = va_arg(*s,int);
+	*maplen = off + _arr_elements(ndim,*dim)*elsize;
+	fd = my_openout(file);
+	if (ftruncate(fd,*maplen)) die("Couldn't size %s\n",file);
+	*map = mmap(NULL,*maplen,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (*map == MAP_FAILED) die("Couldn't map %s\n",file);
+	memcpy(*map,ARRFILE_MAGIC,4);
+	hdr = (int *)((char *)*map + 4);
+	hdr[0] = elsize;
+	hdr[1] = ndim;
+	for (i = 0; i < ndim; i++) hdr[2+i] = (*dim)[i];
+	*data = (char *)*map + off;
+}
+dArray create_mapped_dArray (char *file, int ndim, ...) {
+	dArray new = (dArray)_new_array_header();
+	va_list s;
+	va_start(s,ndim);
+	new->ndim = ndim;
+	_create_mapped(file,sizeof(double),ndim,&s,&new->dim,
+		(void **)&new->data,&new->map,&new->maplen);
+	va_end(s);
+	new->size = _init_strides(ndim,new->dim,&new->stride);
+	return new;
+}
+iArray create_mapped_iArray (char *file, int ndim, ...) {
+	iArray new = (iArray)_new_array_header();
+	va_list s;
+	va_start(s,ndim);
+	new->ndim = ndim;
+	_create_mapped(file,sizeof(int),ndim,&s,&new->dim,
+		(void **)&new->data,&new->map,&new->maplen);
+	va_end(s);
+	new->size = _init_strides(ndim,new->dim,&new->stride);
+	return new;
+}
+
+/* pushes a read-write mapping back to its file; a no-op for the rest */
+static void _sync_map (void *map, size_t maplen, char *name) {
+	if (map && msync(map,maplen,MS_SYNC))
+		warn("Couldn't sync %s to disk\n",name?name:"array");
+}
+void sync_dArray (dArray arr) { _sync_map(arr->map,arr->maplen,arr->name); }
+void sync_iArray (iArray arr) { _sync_map(arr->map,arr->maplen,arr->name); }
+
+static int _file_slot (char *specific) {
+	if (!specific || !file_index) return -1;
+	return (int)hm_geti(file_index,specific,0) - 1;
+}
+char *_get_filename (char *specific, int nodefault) {
+	int i = _file_slot(specific);
+	if (i < 0) return NULL;
+	if (!file_names[i].filename || !*file_names[i].filename) if (!nodefault)
+		default_file(file_names[i].filename,all_base,file_names[i].specific);
+	file_names[i].changed = 0;
+	return *file_names[i].filename;
+}
+int new_file (char *spec) {
+	int i = _file_slot(spec);
+	return i >= 0 && file_names[i].changed ? 1 : 0;
+}
+void claim_not_new (char *spec) {
+	int i = _file_slot(spec);
+	if (i >= 0) file_names[i].changed = 0;
+}
+char *get_filename (char *spec) { return _get_filename(spec,0); }
+char *get_filename_nod (char *spec) { return _get_filename(spec,1); }
+
+void set_filename (char *specific, char *name) {
+	int i = _file_slot(specific);
+	if (i < 0) return;
+	if (is(*file_names[i].filename,name)) return;
+	file_names[i].changed = 1;
+	*file_names[i].filename = name;
+}
+
+void dump_counter (Counter c) {
+	if (!c) { warn("Counter is null!\n"); return; }
+	warn("DISPLAY={%s} <mod=%d wait=%d> %s c=%lld expect=%lld\nt=%f nt=%f\n%s %s\n",
+		c->display, c->mod, c->wait, c->persec?"persec":"!persec",
+		c->c, c->expect, c->t,c->nt,c->title?"title":"!title",c->finish?"finished":"!finished");
+}
+
+/* CLOCKS: now()/now_ns() are monotonic (MYC_CLOCK), so intervals survive
+ * NTP steps; wallclock()/NOW() are seconds since the epoch, for display.
+ * ticks() is the cheapest thing available for timing hot loops: the TSC
+ * where it's invariant, otherwise now_ns(). ticks_per_sec() calibrates it
+ * against the monotonic clock the first time it's asked.
+ */
+#ifndef MYC_CLOCK
+#define MYC_CLOCK CLOCK_MONOTONIC
+#endif
+
+long long now_ns (void) {
+	struct timespec t;
+	clock_gettime(MYC_CLOCK,&t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+double now (void) {
+	struct timespec t;
+	clock_gettime(MYC_CLOCK,&t);
+	return t.tv_sec + (0.000000001 * t.tv_nsec);
+}
+double wallclock (void) {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME,&t);
+	return t.tv_sec + (0.000000001 * t.tv_nsec);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+static int _tsc_ok (void) {
+	static int ok = -1;
+	unsigned a, b, c, d;
+	if (ok < 0)
+		ok = __get_cpuid(0x80000007,&a,&b,&c,&d) && (d & (1<<8)) ? 1 : 0;
+	return ok;
+}
+unsigned long long ticks (void) {
+	return _tsc_ok() ? __rdtsc() : (unsigned long long)now_ns();
+}
+#else
+static int _tsc_ok (void) { return 0; }
+unsigned long long ticks (void) { return now_ns(); }
+#endif
+
+double ticks_per_sec (void) {
+	static double rate = 0;
+	long long t0, t1;
+	unsigned long long r0, r1;
+	if (rate) return rate;
+	if (!_tsc_ok()) return rate = 1e9;
+	t0 = now_ns();
+	r0 = ticks();
+	do t1 = now_ns(); while (t1 - t0 < 20000000);
+	r1 = ticks();
+	rate = (double)(r1 - r0) * 1e9 / (t1 - t0);
+	if (verbose > 1) warnq("TSC runs at %.0f ticks/sec\n",rate);
+	return rate;
+}
+double ticks_to_sec (unsigned long long t) { return t / ticks_per_sec(); }
+
+/* REGIONS are named stretches of code to time: REGION_BEGIN(tag) ...
+ * REGION_END(tag) in the same block, or region_new/region_begin/region_end
+ * by hand. Every thread records into its own stats, so the hot path takes
+ * no locks: call count, total/min/max ticks, and a histogram with four
+ * buckets per power of two. At exit the merged numbers go to stderr in
+ * region_format (REGION_TEXT, REGION_CSV, REGION_JSON or REGION_NONE),
+ * with each region's share of the time since program_start.
+ */
+#define REGION_MAX 256
+#define REGION_BUCKETS 256
+struct region { char *name; int id; };
+struct _region_stat {
+	long long count;
+	unsigned long long total, min, max;
+	long long hist[REGION_BUCKETS];
+};
+struct _region_thread {
+	struct _region_stat *stats[REGION_MAX];
+	struct _region_thread *next;
+};
+static struct region regions[REGION_MAX];
+static int n_regions;
+static struct _region_thread *region_threads;
+static __thread struct _region_thread *my_regions;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+int region_format = REGION_TEXT;
+
+static void _region_atexit (void) { region_report(region_format); }
+
+Region region_new (char *name) {
+	Region r = NULL;
+	int i;
+	pthread_mutex_lock(&region_lock);
+	for (i = 0; i < n_regions; i++)
+		if (!strcmp(regions[i].name,name)) r = &regions[i];
+	if (!r) {
+		if (n_regions == REGION_MAX) die("Too many timing regions (%s)\n",name);
+		if (!n_regions) atexit(_region_atexit);
+		r = &regions[n_regions];
+		r->name = name;
+		r->id = n_regions++;
+	}
+	pthread_mutex_unlock(&region_lock);
+	return r;
+}
+
+static struct _region_stat *_region_stat (Region r) {
+	struct _region_stat *st;
+	if (!my_regions) {
+		my_regions = (struct _region_thread *)calloc(1,sizeof(struct _region_thread));
+		if (!my_regions) die("Couldn't allocate timing regions\n");
+		pthread_mutex_lock(&region_lock);
+		my_regions->next = region_threads;
+		region_threads = my_regions;
+		pthread_mutex_unlock(&region_lock);
+	}
+	if (!(st = my_regions->stats[r->id])) {
+		st = (struct _region_stat *)calloc(1,sizeof(struct _region_stat));
+		if (!st) die("Couldn't allocate stats for region %s\n",r->name);
+		st->min = ~0ULL;
+		my_regions->stats[r->id] = st;
+	}
+	return st;
+}
+
+/* four buckets per power of two: the top bit picks the octave, the next
+ * two bits pick the quarter */
+static int _region_bucket (unsigned long long t) {
+	int msb;
+	if (t < 4) return t;
+	msb = 63 - __builtin_clzll(t);
+	return (msb << 2) | ((t >> (msb - 2)) & 3);
+}
+static unsigned long long _region_bucket_top (int b) {
+	if (b < 4) return b;
+	return ((4ULL | (b & 3)) + 1) << ((b >> 2) - 2);
+}
+
+unsigned long long region_begin (void) { return ticks(); }
+void region_end (Region r, unsigned long long start) {
+	unsigned long long t = ticks() - start;
+	struct _region_stat *st = _region_stat(r);
+	st->count++;
+	st->total += t;
+	if (t < st->min) st->min = t;
+	if (t > st->max) st->max = t;
+	st->hist[_region_bucket(t)]++;
+}
+
+static double _region_pct (struct _region_stat *st, double pct) {
+	long long want = st->count * pct, seen = 0;
+	int b;
+	for (b = 0; b < REGION_BUCKETS; b++)
+		if ((seen += st->hist[b]) > want) break;
+	return _region_bucket_top(b);
+}
+
+void region_report (int format) {
+	struct _region_thread *th;
+	struct _region_stat sum, *st;
+	double ns = 1e9 / ticks_per_sec();
+	double elapsed = now() - program_start;
+	double total, pct, mean, p50, p99;
+	int i, b, shown = 0;
+	if (format == REGION_NONE || !n_regions) return;
+	pthread_mutex_lock(&region_lock);
+	if (format == REGION_TEXT)
+		warn("%-24s %10s %10s %6s %10s %10s %10s %10s %10s\n","region","calls",
+			"total(s)","%prog","mean(ns)","min(ns)","max(ns)","~p50(ns)","~p99(ns)");
+	else if (format == REGION_CSV)
+		warn("region,calls,total_s,pct_prog,mean_ns,min_ns,max_ns,p50_ns,p99_ns\n");
+	else warn("[");
+	for (i = 0; i < n_regions; i++) {
+		memset(&sum,0,sizeof(sum));
+		sum.min = ~0ULL;
+		for (th = region_threads; th; th = th->next) {
+			if (!(st = th->stats[i])) continue;
+			sum.count += st->count;
+			sum.total += st->total;
+			if (st->min < sum.min) sum.min = st->min;
+			if (st->max > sum.max) sum.max = st->max;
+			for (b = 0; b < REGION_BUCKETS; b++) sum.hist[b] += st->hist[b];
+		}
+		if (!sum.count) continue;
+		total = sum.total * ns / 1e9;
+		pct = elapsed > 0 ? 100 * total / elapsed : 0;
+		mean = sum.total * ns / sum.count;
+		p50 = _region_pct(&sum,.5) * ns;
+		p99 = _region_pct(&sum,.99) * ns;
+		if (format == REGION_TEXT)
+			warn("%-24s %10lld %10.4f %6.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+				regions[i].name,sum.count,total,pct,mean,
+				sum.min*ns,sum.max*ns,p50,p99);
+		else if (format == REGION_CSV)
+			warn("%s,%lld,%.6f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				regions[i].name,sum.count,total,pct,mean,
+				sum.min*ns,sum.max*ns,p50,p99);
+		else
+			warn("%s\n {\"region\":\"%s\",\"calls\":%lld,\"total_s\":%.6f,"
+				"\"pct_prog\":%.2f,\"mean_ns\":%.1f,\"min_ns\":%.1f,"
+				"\"max_ns\":%.1f,\"p50_ns\":%.1f,\"p99_ns\":%.1f}",
+				shown?",":"",regions[i].name,sum.count,total,pct,mean,
+				sum.min*ns,sum.max*ns,p50,p99);
+		shown++;
+	}
+	if (format == REGION_JSON) warn("\n]\n");
+	pthread_mutex_unlock(&region_lock);
+}
+
+/* appends to a fixed-size line buffer, so a report is one warnq call */
+static void _catf (char *line, const char *fmt, ...) {
+	size_t l = strlen(line);
+	va_list s;
+	va_start(s,fmt);
+	vsnprintf(line+l,COUNT_LINE-l,fmt,s);
+	va_end(s);
+}
+
+static void _count_report (Counter c, int first_time) {
+	TIME_T time, diff, tavg, finish;
+	double rate, add;
+	COUNT_T cavg, left;
+	long tofinish;
+	struct tm *localtm;
+	char howlong[100], date[100], line[COUNT_LINE];
+	int i, j, curr, has_rate = 0;
+	howlong[0] = date[0] = line[0] = '\0';
+	time = now();
+	diff = time - c->t;
+	if (!c->finish
+		&& !first_time
+		&& (c->expect || c->persec)
+		&& diff) {
+		curr = c->trackcur;
+		c->ctrack[curr] = (c->down ? (c->expect - c->c) : c->c);
+		c->ttrack[curr] = diff;
+		c->trackfill++;
+		if (c->trackfill > c->average) c->trackfill = c->average;
+		cavg = 0;
+		tavg = 0;
+		for (i = 0; i < c->trackfill; i++) {
+			j = curr - i;
+			if (j < 0) j += c->average;
+			cavg += c->ctrack[j];
+			tavg += c->ttrack[j];
+			rate += ((double)cavg)/tavg;
+		}
+		cavg /= c->trackfill;
+		tavg /= c->trackfill;
+		rate = ((double)cavg/tavg);
+//			rate /= c->trackfill;
+		if (!rate) rate = 1.0;
+		has_rate = 1;
+		if (c->expect) {
+			if (c->down) left = c->c;
+			else left = c->expect - c->c;
+			add = left / rate;
+			finish = c->t + diff + add;
+		}
+		c->trackcur++;
+		c->trackcur = c->trackcur % c->average;
+	}
+	if (counters_OK) {
+		if (c->title) _catf(line,"\e]2;%s %lld\007", c->display, c->c);
+		_catf(line,"%s %6lld",c->display,c->c);
+		if (c->expect) _catf(line,"/%lld",c->expect);
+		_catf(line," -- %4d ",(int)diff);
+		if (c->persec && has_rate) {
+			if (rate > .8) _catf(line,"[%.2f/sec] ",rate);
+			else _catf(line,"[%.2f seconds per] ",1/rate);
+		}
+		_catf(line,"%5.2f",time-program_start);
+		if (c->expect && has_rate && (c->hms || c->date)) {
+			tofinish = wallclock() + (finish - time);
+			if (c->hms) {
+				long fin = finish - time;
+				int dhms[4], intvl[] = { 86400, 3600, 60, 1, 0 };
+				char *label[] = { "d", "h", "m", "s", NULL };
+				int i, printed = 0;
+				if (fin > 3600) c->date = 1;
+				for (i = 0; intvl[i]; i++) {
+					if (i) fin %= intvl[i-1];
+					if (!(fin / intvl[i])) continue;
+					sprintf(howlong+strlen(howlong),
+						"%s%02d%s",
+						(printed?":":""),
+						fin / intvl[i],
+						label[i]
+					);
+					printed++;
+				}
+			}
+			if (c->date) {
+				localtm = localtime(&tofinish);
+				strftime(date,100,"%Y/%m/%d@%H:%M:%S",localtm);
+			}
+			if (*howlong && *date) _catf(line," [%s->%s]",howlong,date);
+			else _catf(line," [->%s]",(*howlong ? howlong : date));
+		}
+		_catf(line,"\n");
+		warnq("%s",line);
+	}
+	if (!c->mod) c->nt = c->t + c->wait * (1 + (diff/c->wait));
+}
+
+/* Checking the clock on every count is most of what count() costs, so
+ * only look every c->every counts, and adjust that so the clock gets read
+ * about once a millisecond.
+ */
+static int _count_due (Counter c) {
+	double t;
+	if (--c->tick > 0) return 0;
+	t = now();
+	if (t - c->checked < 0.001) { if (c->every < (1<<20)) c->every <<= 1; }
+	else if (t - c->checked > 0.01 && c->every > 1) c->every >>= 1;
+	c->checked = t;
+	c->tick = c->every;
+	return t > c->nt;
+}
+
+/* THREADED counters (gen_counter(...,"threaded",...)) can be counted from
+ * any number of threads. The nth thread to count anything owns slots[n]
+ * of every counter, a cache line nobody else writes, so count() is a
+ * plain load and store rather than a locked add. A reporter thread wakes
+ * every c->wait seconds to add the slots up and print. Threads past the
+ * end of slots[] share slots[0] and pay for the atomic add. count_slot()
+ * returns the slot itself, so a hot loop can count_local() into it
+ * without the thread-local lookup either. "mod" is ignored.
+ */
+#define COUNT_SLOTS 64
+struct _count_slot {
+	COUNT_T n; // owner stores, reporter loads, both __atomic relaxed
+	struct _count_slot *next; // c->extra
+	char pad[CACHELINE - sizeof(COUNT_T) - sizeof(void *)];
+};
+static _Atomic int count_threads;
+static __thread int tl_count_slot = -1;
+
+/* 1..COUNT_SLOTS-1: the calling thread's own slot; 0: the shared one */
+static int _count_index (void) {
+	int k;
+	if (tl_count_slot < 0) {
+		k = atomic_fetch_add(&count_threads,1) + 1;
+		tl_count_slot = k < COUNT_SLOTS ? k : 0;
+	}
+	return tl_count_slot;
 }
-int new_file (char *spec) {
-	int i;
-	for (i = 0; file_names[i].specific; i++)
-		if (is(spec,file_names[i].specific))
-			return file_names[i].changed ? 1 : 0;
-	return 0;
+static void _count_add (Counter c, COUNT_T n) {
+	int k = _count_index();
+	if (k) count_local(&c->slots[k].n,n);
+	else __atomic_fetch_add(&c->slots[0].n,n,__ATOMIC_RELAXED);
 }
-void claim_not_new (char *spec) {
+/* a thread without a slot of its own gets a new one on c->extra, so call
+ * this once per thread and keep the result */
+CountSlot count_slot (Counter c) {
+	struct _count_slot *s;
+	int k;
+	if (!c->threaded) die("count_slot needs a threaded counter\n");
+	if ((k = _count_index())) return &c->slots[k].n;
+	if (posix_memalign((void **)&s,CACHELINE,sizeof(struct _count_slot)))
+		die("Couldn't allocate counter slot\n");
+	memset(s,0,sizeof(struct _count_slot));
+	pthread_mutex_lock(&c->lock);
+	s->next = c->extra;
+	c->extra = s;
+	pthread_mutex_unlock(&c->lock);
+	return &s->n;
+}
+/* caller holds c->lock */
+static COUNT_T _count_value (Counter c) {
+	struct _count_slot *s;
+	COUNT_T n = 0;
 	int i;
-	for (i = 0; file_names[i].specific; i++)
-		if (is(spec,file_names[i].specific))
-			file_names[i].changed = 0;
+	for (i = 0; i < COUNT_SLOTS; i++)
+		n += __atomic_load_n(&c->slots[i].n,__ATOMIC_RELAXED);
+	for (s = c->extra; s; s = s->next)
+		n += __atomic_load_n(&s->n,__ATOMIC_RELAXED);
+	return c->down ? c->expect - n : n;
 }
-char *get_filename (char *spec) { return _get_filename(spec,0); }
-char *get_filename_nod (char *spec) { return _get_filename(spec,1); }
 
-void set_filename (char *specific, char *name) {
-	int i;
-	for (i = 0; file_names[i].specific; i++)
-		if (is(specific,file_names[i].specific))
-			break;
-	if (!file_names[i].specific) return;
-	if (is(*file_names[i].filename,name)) return;
-	file_names[i].changed = 1;
-	*file_names[i].filename = name;
+static void *_count_reporter (void *arg) {
+	Counter c = (Counter)arg;
+	struct timespec ts;
+	pthread_mutex_lock(&c->lock);
+	while (!c->stop) {
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		ts.tv_sec += c->wait > 0 ? c->wait : 1;
+		pthread_cond_timedwait(&c->wake,&c->lock,&ts);
+		if (c->stop) break;
+		c->c = _count_value(c);
+		_count_report(c,0);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
 }
 
-void dump_counter (Counter c) {
-	if (!c) { warn("Counter is null!\n"); return; }
-	warn("DISPLAY={%s} <mod=%d wait=%d> %s c=%lld expect=%lld\nt=%f nt=%f\n%s %s\n",
-		c->display, c->mod, c->wait, c->persec?"persec":"!persec",
-		c->c, c->expect, c->t,c->nt,c->title?"title":"!title",c->finish?"finished":"!finished");
+static void _count_start (Counter c) {
+	pthread_condattr_t attr;
+	if (posix_memalign((void **)&c->slots,CACHELINE,
+			COUNT_SLOTS*sizeof(struct _count_slot)))
+		die("Couldn't allocate counter slots\n");
+	memset(c->slots,0,COUNT_SLOTS*sizeof(struct _count_slot));
+	pthread_mutex_init(&c->lock,NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&c->wake,&attr);
+	pthread_condattr_destroy(&attr);
+	c->t = now();
+	if (c->display && pthread_create(&c->reporter,NULL,_count_reporter,c))
+		die("Couldn't start counter reporter\n");
 }
 
-double now (void) {
-	struct timeval t;
-	gettimeofday(&t,NULL);
-	return t.tv_sec + (0.000001 * t.tv_usec);
+static void _count_stop (Counter c) {
+	if (c->stop) return;
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+	if (c->display) pthread_join(c->reporter,NULL);
 }
 
 void count (Counter c) {
-	TIME_T time, diff, tavg, finish;
-	double rate, add;
-	COUNT_T cavg, left;
-	long tofinish;
-	struct tm *localtm;
-	char howlong[100], date[100];
-	int i, j, curr, first_time, has_rate = 0;
-	howlong[0] = date[0] = '\0';
+	int first_time;
+	if (c->threaded) { _count_add(c,1); return; }
 	first_time = (c->down ? (c->c == c->expect) : !c->c);
 	if (!c->t && first_time) c->t = now();
 	if (c->display &&
 		(c->finish
 		|| (c->mod && !(c->c % c->mod))
-		|| (now() > c->nt))
-		) {
-		time = now();
-		diff = time - c->t;
-		if (!c->finish
-			&& !first_time
-			&& (c->expect || c->persec)
-			&& diff) {
-			curr = c->trackcur;
-			c->ctrack[curr] = (c->down ? (c->expect - c->c) : c->c);
-			c->ttrack[curr] = diff;
-			c->trackfill++;
-			if (c->trackfill > c->average) c->trackfill = c->average;
-			cavg = 0;
-			tavg = 0;
-			for (i = 0; i < c->trackfill; i++) {
-				j = curr - i;
-				if (j < 0) j += c->average;
-				cavg += c->ctrack[j];
-				tavg += c->ttrack[j];
-				rate += ((double)cavg)/tavg;
-			}
-			cavg /= c->trackfill;
-			tavg /= c->trackfill;
-			rate = ((double)cavg/tavg);
-//			rate /= c->trackfill;
-			if (!rate) rate = 1.0;
-			has_rate = 1;
-			if (c->expect) {
-				if (c->down) left = c->c;
-				else left = c->expect - c->c;
-				add = left / rate;
-				finish = c->t + diff + add;
-			}
-			c->trackcur++;
-			c->trackcur = c->trackcur % c->average;
-		}
-		if (counters_OK) {
-			if (c->title) warnq("\e]2;%s %lld\007", c->display, c->c);
-			warnq("%s %6lld",c->display,c->c);
-			if (c->expect) warnq("/%lld",c->expect);
-			warnq(" -- %4d ",(int)diff);
-			if (c->persec && has_rate) {
-				if (rate > .8) warnq("[%.2f/sec] ",rate);
-				else warnq("[%.2f seconds per] ",1/rate);
-			}
-			warnq("%5.2f",time-program_start);
-			if (c->expect && has_rate && (c->hms || c->date)) {
-				tofinish = finish;
-				if (c->hms) {
-					long fin = finish - time;
-					int dhms[4], intvl[] = { 86400, 3600, 60, 1, 0 };
-					char *label[] = { "d", "h", "m", "s", NULL };
-					int i, printed = 0;
-					if (fin > 3600) c->date = 1;
-					for (i = 0; intvl[i]; i++) {
-						if (i) fin %= intvl[i-1];
-						if (!(fin / intvl[i])) continue;
-						sprintf(howlong+strlen(howlong),
-							"%s%02d%s",
-							(printed?":":""),
-							fin / intvl[i],
-							label[i]
-						);
-						printed++;
-					}
-				}
-				if (c->date) {
-					localtm = localtime(&tofinish);
-					strftime(date,100,"%Y/%m/%d@%H:%M:%S",localtm);
-				}
-				if (*howlong && *date) warnq(" [%s->%s]",howlong,date);
-				else warnq(" [->%s]",(*howlong ? howlong : date));
-			}
-			warnq("\n");
-		}
-		if (!c->mod) c->nt = c->t + c->wait * (1 + (diff/c->wait));
-	}
+		|| _count_due(c))
+		)
+		_count_report(c,first_time);
 	c->c += c->down ? -1 : 1;
 }
-void count_inc (Counter c, COUNT_T inc) { inc--; count(c); c->c += inc; }
-void count_dec (Counter c, COUNT_T dec) { dec++; count(c); c->c -= dec; }
-void finish (Counter c) { c->finish = 1; count(c); }
+void count_inc (Counter c, COUNT_T inc) {
+	if (c->threaded) { _count_add(c,inc); return; }
+	inc--; count(c); c->c += inc;
+}
+void count_dec (Counter c, COUNT_T dec) {
+	if (c->threaded) { _count_add(c,-dec); return; }
+	dec++; count(c); c->c -= dec;
+}
+void finish (Counter c) {
+	if (c->threaded) {
+		_count_stop(c);
+		pthread_mutex_lock(&c->lock);
+		c->c = _count_value(c);
+		pthread_mutex_unlock(&c->lock);
+		c->finish = 1;
+		if (c->display) _count_report(c,0);
+		return;
+	}
+	c->finish = 1; count(c);
+}
 
 char *get_optpart (char *arg) {
-	int i;
-	char *tmp = NULL;
-	if (!arg) return tmp;
-	for (i = 0; arg[i] && arg[i]!='='; i++);
-	tmp = my_mallocc(i+1,"option string");
-	tmp[i] = 0;
-	while (i-- >= 0) tmp[i] = arg[i];
-	return tmp;
+	if (!arg) return NULL;
+	return sv_dup(sv_n(arg,str_find(arg,'=')-arg));
 }
 
 int is_in (char *target, char *potential, ...) {
@@ -879,60 +3676,325 @@ int is_in (char *target, char *potential, ...) {
 	return 0;
 }
 
-char *get_next_argp (char ***argv, char *arg) {
-	char *tmp;
-	tmp = argval(arg);
-	if (!tmp) {
-		tmp = *(++(*argv));
-		if (tmp) tmp = my_strcpy(tmp);
-	}
-	if (!tmp) die("Option %s needs an argument\n",arg);
+/* the value after '=' or in the next argument, in place */
+static char *_argp_value (char ***argv, char *arg) {
+	char *tmp = str_find(arg,'=');
+	if (*tmp) return tmp+1;
+	if (!(tmp = *(++(*argv)))) die("Option %s needs an argument\n",arg);
 	return tmp;
 }
+char *get_next_argp (char ***argv, char *arg) {
+	return my_strcpy(_argp_value(argv,arg));
+}
 double get_next_argpd (char ***argv, char *arg) {
-	char *tmp = get_next_argp(argv,arg);
-	return atof(tmp);
+	return parse_d(_argp_value(argv,arg),NULL);
 }
 long get_next_argpl (char ***argv, char *arg) {
-	char *tmp = get_next_argp(argv,arg);
-	return atol(tmp);
+	return parse_ll(_argp_value(argv,arg),NULL);
 }
 long long get_next_argpll (char ***argv, char *arg) {
-	char *tmp = get_next_argp(argv,arg);
-	return atoll(tmp);
+	return parse_ll(_argp_value(argv,arg),NULL);
 }
 int get_next_argpi (char ***argv, char *arg) {
 	return (int)get_next_argpl(argv,arg);
 }
-char *get_next_arg (va_list *t, char *opt) {
-	char *tmp;
-	tmp = argval(opt);
-	if (!tmp) {
-		tmp = va_arg(*t,char*);
-		if (tmp) tmp = my_strcpy(tmp);
-	}
-	if (!tmp) die("Option %s needs an argument\n",opt);
+/* threads=N / threads N; sets myc_threads (0 = one per CPU) */
+int get_threads_argp (char ***argv, char *arg) {
+	int n = get_next_argpi(argv,arg);
+	if (n < 0) die("Option %s needs a thread count, not %d\n",arg,n);
+	return myc_threads = n;
+}
+static char *_arg_value (va_list *t, char *opt) {
+	char *tmp = str_find(opt,'=');
+	if (*tmp) return tmp+1;
+	if (!(tmp = va_arg(*t,char*))) die("Option %s needs an argument\n",opt);
 	return tmp;
 }
+char *get_next_arg (va_list *t, char *opt) {
+	return my_strcpy(_arg_value(t,opt));
+}
 double get_next_argd (va_list *t, char *opt) {
-	char *tmp = get_next_arg(t,opt);
-	return atof(tmp);
+	return parse_d(_arg_value(t,opt),NULL);
 }
 long long get_next_argll (va_list *t, char *opt) {
-	char *tmp = get_next_arg(t,opt);
-	return atoll(tmp);
+	return parse_ll(_arg_value(t,opt),NULL);
 }
 long get_next_argl (va_list *t, char *opt) {
-	char *tmp = get_next_arg(t,opt);
-	return atol(tmp);
+	return parse_ll(_arg_value(t,opt),NULL);
 }
 int get_next_argi (va_list *t, char *opt) {
 	return (int)get_next_argl(t,opt);
 }
+
+/* OPTION TABLES: a {NULL}-terminated OptSpec array is compiled once into
+ * a perfect hash (hash-and-displace: every bucket of names gets its own
+ * seed that lands all of them on free slots). After that an option costs
+ * one hash of its name part, one strncmp and a parse straight into the
+ * destination - nothing is copied or allocated. "avg|average" gives
+ * aliases; OPT_PREFIX specs match any option starting with the name
+ * ("expect" takes "expected=10"). Values come after '=' or from the next
+ * argument. A value that isn't a number dies, unless the spec has
+ * OPT_LAX (the old get_next_arg* behaviour: whatever prefix parses).
+ * dest is an absolute address, or NULL plus an OPT_FIELD offset into the
+ * struct given to the parse call, so one table can fill any number of
+ * instances.
+ */
+struct opttable {
+	OptSpec *specs;
+	int nslots, nbuckets;
+	int *slot;         /* name index in each hash slot, -1 if empty */
+	unsigned *disp;    /* seed for each bucket */
+	char **names;      /* every name and alias */
+	int *namelen, *spec, nnames;
+	int *prefix, nprefix;
+};
+
+static unsigned _opt_hash (const char *s, int len, unsigned seed) {
+	unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+	int i;
+	for (i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h ^ (h >> 15);
+}
+static int _opt_namelen (const char *arg) {
+	return (int)(str_find((char *)arg,'=') - arg);
+}
+static int _by_bucket_size (const void *a, const void *b) {
+	const int *x = (const int *)a, *y = (const int *)b;
+	return (y[1] != x[1]) ? y[1] - x[1] : x[0] - y[0];
+}
+
+OptTable opt_compile (OptSpec *specs) {
+	OptTable t = (OptTable)my_malloc(sizeof(struct opttable),"option table");
+	int i, j, k, n = 0, nk, b, ok, *bucket, *order, *taken;
+	char *p, *bar;
+	unsigned d;
+	t->specs = specs;
+	for (i = 0; specs[i].name; i++)
+		for (n++, p = specs[i].name; (p = strchr(p,'|')); p++) n++;
+	t->names = (char **)my_malloc((n?n:1)*sizeof(char *),"option names");
+	t->namelen = my_malloci(n,"option name lengths");
+	t->spec = my_malloci(n,"option specs");
+	t->prefix = my_malloci(n,"prefix options");
+	for (i = 0; specs[i].name; i++)
+		for (p = specs[i].name; p; p = bar ? bar+1 : NULL) {
+			bar = strchr(p,'|');
+			k = bar ? (int)(bar - p) : (int)strlen(p);
+			t->names[t->nnames] = my_mallocc(k+1,"option name");
+			memcpy(t->names[t->nnames],p,k);
+			t->namelen[t->nnames] = k;
+			t->spec[t->nnames] = i;
+			if (specs[i].type & OPT_PREFIX) t->prefix[t->nprefix++] = t->nnames;
+			t->nnames++;
+		}
+	nk = t->nnames;
+	for (t->nslots = 8; t->nslots < 2*nk; t->nslots *= 2);
+	t->nbuckets = nk/4 + 1;
+	t->slot = my_malloci(t->nslots,"option slots");
+	t->disp = (unsigned *)my_malloc(t->nbuckets*sizeof(unsigned),"option seeds");
+	for (i = 0; i < t->nslots; i++) t->slot[i] = -1;
+	bucket = my_malloci(nk,"option buckets");
+	order = my_malloci(2*t->nbuckets,"option bucket order");
+	taken = my_malloci(nk,"option placement");
+	for (b = 0; b < t->nbuckets; b++) order[2*b] = b;
+	for (k = 0; k < nk; k++) {
+		if (specs[t->spec[k]].type & OPT_PREFIX) { bucket[k] = -1; continue; }
+		bucket[k] = _opt_hash(t->names[k],t->namelen[k],0) % t->nbuckets;
+		order[2*bucket[k]+1]++;
+	}
+	/* biggest buckets first, while there's the most room */
+	qsort(order,t->nbuckets,2*sizeof(int),_by_bucket_size);
+	for (i = 0; i < t->nbuckets && order[2*i+1]; i++) {
+		b = order[2*i];
+		for (d = 1; ; d++) {
+			for (ok = 1, j = 0, k = 0; ok && k < nk; k++) {
+				if (bucket[k] != b) continue;
+				taken[j] = _opt_hash(t->names[k],t->namelen[k],d) & (t->nslots-1);
+				if (t->slot[taken[j]] >= 0) ok = 0;
+				else t->slot[taken[j++]] = k;
+			}
+			if (ok) break;
+			while (j--) t->slot[taken[j]] = -1;
+			if (d > 1000000) {
+				StrBuf names = sb_new(64);
+				for (k = 0; k < nk; k++)
+					if (bucket[k] == b) sb_appendf(names," %s",t->names[k]);
+				die("Couldn't hash options%s (one listed twice?)\n",names->s);
+			}
+		}
+		t->disp[b] = d;
+	}
+	my_free(bucket);
+	my_free(order);
+	my_free(taken);
+	return t;
+}
+
+void opt_free (OptTable t) {
+	int i;
+	for (i = 0; i < t->nnames; i++) my_free(t->names[i]);
+	my_free(t->names);
+	my_free(t->namelen);
+	my_free(t->spec);
+	my_free(t->prefix);
+	my_free(t->slot);
+	my_free(t->disp);
+	my_free(t);
+}
+
+/* the spec matching arg's name part, or NULL */
+OptSpec *opt_find (OptTable t, const char *arg) {
+	int len = _opt_namelen(arg), s, i, k;
+	s = _opt_hash(arg,len,t->disp[_opt_hash(arg,len,0) % t->nbuckets]) & (t->nslots-1);
+	if ((k = t->slot[s]) >= 0 && t->namelen[k] == len && !strncmp(t->names[k],arg,len))
+		return &t->specs[t->spec[k]];
+	for (i = 0; i < t->nprefix; i++) {
+		k = t->prefix[i];
+		if (len >= t->namelen[k] && !strncmp(arg,t->names[k],t->namelen[k]))
+			return &t->specs[t->spec[k]];
+	}
+	return NULL;
+}
+
+/* edit distance, for suggestions; only runs on the way to dying */
+static int _levenshtein (const char *a, int la, const char *b, int lb) {
+	int *row = my_malloci(lb+1,"edit distance"), i, j, diag, up, best;
+	for (j = 0; j <= lb; j++) row[j] = j;
+	for (i = 1; i <= la; i++) {
+		diag = row[0];
+		row[0] = i;
+		for (j = 1; j <= lb; j++) {
+			up = row[j];
+			best = diag + (a[i-1] != b[j-1]);
+			if (up + 1 < best) best = up + 1;
+			if (row[j-1] + 1 < best) best = row[j-1] + 1;
+			row[j] = best;
+			diag = up;
+		}
+	}
+	best = row[lb];
+	my_free(row);
+	return best;
+}
+/* the closest known name to arg, if any is reasonably close */
+char *opt_suggest (OptTable t, const char *arg) {
+	int len = _opt_namelen(arg), i, d, best = len/3 + 2;
+	char *r = NULL;
+	for (i = 0; i < t->nnames; i++) {
+		d = _levenshtein(arg,len,t->names[i],t->namelen[i]);
+		if (d < best) { best = d; r = t->names[i]; }
+	}
+	return r;
+}
+void opt_unknown (OptTable t, char *what, char *arg) {
+	char *s = opt_suggest(t,arg);
+	if (s) die("Unknown %s option: %s (did you mean %s?)\n",what,arg,s);
+	die("Unknown %s option: %s\n",what,arg);
+}
+
+static void _opt_store (OptSpec *o, void *base, char *arg, char *val) {
+	void *p = o->dest ? o->dest : (char *)base + o->off;
+	char *end = val;
+	switch (o->type & OPT_TYPE) {
+		case OPT_FLAG:   *(int *)p = (int)o->val; return;
+		case OPT_STR:    *(char **)p = val; return;
+		case OPT_INT:    *(int *)p = (int)parse_ll(val,&end); break;
+		case OPT_LONG:   *(long *)p = (long)parse_ll(val,&end); break;
+		case OPT_LLONG:  *(long long *)p = parse_ll(val,&end); break;
+		case OPT_DOUBLE: *(double *)p = parse_d(val,&end); break;
+		default: die("Option %s has a bad type (%d)\n",arg,o->type);
+	}
+	if (!(o->type & OPT_LAX) && (end == val || *end))
+		die("Option %s wants a number, not '%s'\n",arg,val);
+}
+static char *_opt_inline_value (char *arg) {
+	char *eq = str_find(arg,'=');
+	return *eq ? eq+1 : NULL;
+}
+
+/* **argv is an option: stores it and moves *argv onto its value if that
+ * was a separate argument. Returns 0, touching nothing, if the table
+ * doesn't know it. */
+int opt_parse_argv (OptTable t, void *base, char ***argv) {
+	char *arg = **argv, *val;
+	OptSpec *o = opt_find(t,arg);
+	if (!o) return 0;
+	if ((o->type & OPT_TYPE) == OPT_FLAG) val = NULL;
+	else if (!(val = _opt_inline_value(arg)) && !(val = *(++(*argv))))
+		die("Option %s needs an argument\n",arg);
+	_opt_store(o,base,arg,val);
+	return 1;
+}
+/* the same for option lists passed as varargs (gen_counter style) */
+int opt_parse_va (OptTable t, void *base, char *arg, va_list *s) {
+	char *val;
+	OptSpec *o = opt_find(t,arg);
+	if (!o) return 0;
+	if ((o->type & OPT_TYPE) == OPT_FLAG) val = NULL;
+	else if (!(val = _opt_inline_value(arg)) && !(val = va_arg(*s,char *)))
+		die("Option %s needs an argument\n",arg);
+	_opt_store(o,base,arg,val);
+	return 1;
+}
+static Pool counters;
+void free_counter (Counter c) {
+	struct _count_slot *s;
+	if (!c) return;
+	if (c->threaded) {
+		_count_stop(c);
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->wake);
+		free(c->slots);
+		while ((s = c->extra)) {
+			c->extra = s->next;
+			free(s);
+		}
+	}
+	my_free(c->display);
+	my_free(c->ctrack);
+	my_free(c->ttrack);
+	pool_put(counters,c);
+}
+/* numbers are OPT_LAX, as they were before the table: wait=abc is 0 */
+static OptSpec counter_specs[] = {
+	{ "disp|display", OPT_STR, OPT_FIELD(struct counter,display), 0 },
+	{ "mod", OPT_INT|OPT_LAX, OPT_FIELD(struct counter,mod), 0 },
+	{ "down|backwards", OPT_FLAG, OPT_FIELD(struct counter,down), 1 },
+	{ "persec", OPT_FLAG, OPT_FIELD(struct counter,persec), 1 },
+	{ "threaded|atomic", OPT_FLAG, OPT_FIELD(struct counter,threaded), 1 },
+	{ "wait", OPT_INT|OPT_LAX, OPT_FIELD(struct counter,wait), 0 },
+	{ "avg|average", OPT_INT|OPT_LAX, OPT_FIELD(struct counter,average), 0 },
+	{ "expect", OPT_LLONG|OPT_PREFIX|OPT_LAX, OPT_FIELD(struct counter,expect), 0 },
+	{ "date", OPT_FLAG, OPT_FIELD(struct counter,date), 1 },
+	{ "nodate", OPT_FLAG, OPT_FIELD(struct counter,date), 0 },
+	{ "hms", OPT_FLAG, OPT_FIELD(struct counter,hms), 1 },
+	{ "nohms", OPT_FLAG, OPT_FIELD(struct counter,hms), 0 },
+	{ NULL, 0, NULL, 0, 0 }
+};
+static OptTable counter_opts;
+static pthread_mutex_t counter_opts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* compiled once, on the heap: it outlives whatever arena the first caller had */
+static OptTable _counter_opts (void) {
+	OptTable t = __atomic_load_n(&counter_opts,__ATOMIC_ACQUIRE);
+	Arena a;
+	if (t) return t;
+	pthread_mutex_lock(&counter_opts_lock);
+	if (!(t = counter_opts)) {
+		a = use_arena(NULL);
+		t = opt_compile(counter_specs);
+		use_arena(a);
+		__atomic_store_n(&counter_opts,t,__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&counter_opts_lock);
+	return t;
+}
+
 Counter gen_counter (char *arg, ...) {
-	char *opt;
-	Counter new = (Counter)my_malloc(sizeof(struct counter),"counter");
-	new->display = my_strcpy("counter");
+	Counter new;
+	OptTable opts = _counter_opts();
+	new = (Counter)pool_get(_shared_pool(&counters,sizeof(struct counter),"counter"));
+	memset(new,0,sizeof(struct counter));
+	new->display = "counter";
 	new->c = 0;
 	new->mod = 0;
 	new->wait = 5;
@@ -946,69 +4008,265 @@ Counter gen_counter (char *arg, ...) {
 	va_list s;
 	va_start(s,arg);
 	while (arg) {
-		opt = get_optpart(arg);
-		if (is_in(opt,"disp","display",(char*)NULL)) {
-			new->display = get_next_arg(&s,arg);
-		} else if (is(opt,"mod")) {
-			new->mod = get_next_argi(&s,arg);
-		} else if (is_in(opt,"down","backwards",(char*)NULL)) {
-			new->down = 1;
-		} else if (is(opt,"persec")) {
-			new->persec = 1;
-		} else if (is(opt,"wait")) {
-			new->wait = get_next_argi(&s,arg);
-		} else if (is_in(opt,"avg","average",(char*)NULL)) {
-			new->average = get_next_argi(&s,arg);
-		} else if (starts_with(opt,"expect")) {
-			new->expect = COUNT_GET(get_next_arg)(&s,arg);
-		} else if (is(opt,"date")) {   new->date = 1;
-		} else if (is(opt,"nodate")) { new->date = 0;
-		} else if (is(opt,"hms")) {    new->hms = 1;
-		} else if (is(opt,"nohms")) {  new->hms = 0;
-		} else {
-			die("Unknown counter option: %s\n",arg,is_in(opt,"down",(char*)NULL));
-		}
+		if (!opt_parse_va(opts,new,arg,&s)) opt_unknown(opts,"counter",arg);
 		arg = va_arg(s,char *);
 	}
+	new->display = my_strcpy(new->display);
 	if (new->down) new->c = new->expect;
 	new->ctrack = (COUNT_T *)my_malloc(new->average*sizeof(COUNT_T),"ctrack");
 	new->ttrack = (TIME_T *)my_malloc(new->average*sizeof(TIME_T),"ttrack");
+	new->every = 1;
+	if (new->threaded) _count_start(new);
 	va_end(s);
 	return new;
 }
 
 // # back(i,c') = \sum_{c\in\Sigma} \eta(s_{i+1} | c) \cdot \gamma(c|c') \cdot back(i+1,c)
 
-void init_rand (void) {
-	static int initialized = 0;
-	if (!initialized++) {
-		if (!use_seed) srand48((long)now());
-		else srand48(seed);
+/* RNG: xoshiro256++ (Blackman & Vigna). State lives in a struct rng, so
+ * callers can keep their own; rng_default() is a per-thread one. All
+ * streams come from one master seed (seed if use_seed, else the clock)
+ * by jump-ahead: stream k is the master state jumped k times, 2^128
+ * draws apart. rng_stream(r,k) gives stream k, so parallel code that
+ * keys k on its work item (as randomizeArray does per chunk) gets the
+ * same numbers however the work is scheduled. rng_default() hands out
+ * streams in first-call order, which is only reproducible when one
+ * thread draws; a thread can pin its own with rng_thread(k) instead.
+ */
+static unsigned long long rng_master;
+static pthread_once_t rng_once = PTHREAD_ONCE_INIT;
+static _Atomic int rng_streams;
+static __thread struct rng tl_rng;
+static __thread int tl_rng_ok;
+
+static unsigned long long _splitmix64 (unsigned long long *x) {
+	unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+static unsigned long long _rng_rotl (unsigned long long x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed (Rng r, unsigned long long s) {
+	int i;
+	for (i = 0; i < 4; i++) r->s[i] = _splitmix64(&s);
+}
+
+unsigned long long rng_next (Rng r) {
+	unsigned long long *s = r->s;
+	unsigned long long res = _rng_rotl(s[0] + s[3],23) + s[0], t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = _rng_rotl(s[3],45);
+	return res;
+}
+
+/* advances r by 2^128 draws */
+void rng_jump (Rng r) {
+	static const unsigned long long J[] = {
+		0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+		0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+	};
+	unsigned long long t[4] = { 0, 0, 0, 0 };
+	int i, b, k;
+	for (i = 0; i < 4; i++)
+		for (b = 0; b < 64; b++) {
+			if (J[i] & (1ULL << b))
+				for (k = 0; k < 4; k++) t[k] ^= r->s[k];
+			rng_next(r);
+		}
+	for (k = 0; k < 4; k++) r->s[k] = t[k];
+}
+
+/* uniform on [0,1), 53 random bits */
+double rng_double (Rng r) {
+	return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* uniform on 0..n-1 without modulo bias (Lemire's multiply-and-reject) */
+long rng_below (Rng r, long n) {
+	unsigned long long x = rng_next(r), lim;
+	unsigned __int128 m = (unsigned __int128)x * (unsigned long long)n;
+	if ((unsigned long long)m < (unsigned long long)n) {
+		lim = -(unsigned long long)n % (unsigned long long)n;
+		while ((unsigned long long)m < lim) {
+			x = rng_next(r);
+			m = (unsigned __int128)x * (unsigned long long)n;
+		}
 	}
+	return (long)(m >> 64);
 }
 
-double random_number (void) {
+void rng_fill (Rng r, double *x, long n) {
+	long i;
+	for (i = 0; i < n; i++) x[i] = (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+void rng_fill_dArray (Rng r, dArray arr) { rng_fill(r,arr->data,arr->size); }
+
+static void _rng_init (void) {
+	rng_master = use_seed ? (unsigned long long)seed
+		: (unsigned long long)now_ns() ^ (unsigned long long)wallclock();
+}
+void init_rand (void) { pthread_once(&rng_once,_rng_init); }
+
+/* stream k of the master seed: the master state jumped k times */
+void rng_stream (Rng r, int k) {
 	init_rand();
-	return drand48();
+	rng_seed(r,rng_master);
+	while (k-- > 0) rng_jump(r);
+}
+
+Rng rng_default (void) {
+	if (!tl_rng_ok) {
+		rng_stream(&tl_rng,atomic_fetch_add(&rng_streams,1));
+		tl_rng_ok = 1;
+	}
+	return &tl_rng;
 }
-double random_array_entry (void) {
-	if (perturb) return 1.0 + random_number() * .05;
-	else return 0.5 + random_number();
+/* the calling thread's rng_default() becomes stream k; k should not be one
+ * that first-call numbering has handed (or will hand) to another thread */
+void rng_thread (int k) {
+	rng_stream(&tl_rng,k);
+	tl_rng_ok = 1;
 }
 
-/*
+double random_number (void) {
+	return rng_double(rng_default());
+}
+static double _random_entry (Rng r) {
+	if (perturb) return 1.0 + rng_double(r) * .05;
+	else return 0.5 + rng_double(r);
+}
+double random_array_entry (void) { return _random_entry(rng_default()); }
+
+/* each PAR_CHUNK gets its own generator, seeded from one draw of the
+ * caller's plus the chunk number, so the result depends on the seed but
+ * not on how many threads did the work */
+struct _randomize_job { double *d; unsigned long long base; };
+static void _randomize_chunk (void *v, long a, long b) {
+	struct _randomize_job *j = (struct _randomize_job *)v;
+	struct rng r;
+	rng_seed(&r,j->base + a / PAR_CHUNK);
+	for (; a < b; a++)
+		if (!only_nonzero || j->d[a])
+			j->d[a] = _random_entry(&r);
+}
 void randomizeArray (dArray arr) {
-	long i, d = 1;
+	struct _randomize_job j;
 	if (!randomize) return;
-	for (i = 0; i < arr->ndim; i++) d *= arr->dim[i];
-	for (i = 0; i < d; i++)
-		if (!only_nonzero || arr->data[i])
-			arr->data[i] = random_array_entry();
-	if (arr->ndim == 2)
-		for (i = 0; i < arr->dim[0]; i++)
-			normalizeBut1(arr,i);
+	j.d = arr->data;
+	j.base = rng_next(rng_default());
+	parallel_for(0,arr->size,PAR_CHUNK,_randomize_chunk,&j);
+	if (arr->ndim == 2) dNormalizeLast(arr);
+}
+
+/* SAMPLERS draw indices of a 1-D dArray of weights (any positive scale).
+ * sampler_alias builds Vose's alias table: O(n) to build, O(1) per draw
+ * from a single random double. sampler_cdf keeps the running total and
+ * binary-searches it: O(log n) per draw, but cheap to rebuild with
+ * sampler_reset when the weights keep changing.
+ */
+struct sampler {
+	int n, alias_kind;
+	double *prob;
+	int *alias;
+	double total;
+};
+
+static void _sampler_build (Sampler s, dArray dist) {
+	int n = s->n, i, j, ns = 0, nl = 0, *small, *large;
+	double *w = dist->data, scale;
+	for (i = 0, s->total = 0; i < n; i++) {
+		if (w[i] < 0 || w[i] != w[i]) die("Sampler weight %d is %g\n",i,w[i]);
+		s->total += w[i];
+	}
+	if (!(s->total > 0)) die("Sampler weights sum to %g\n",s->total);
+	if (!s->alias_kind) {
+		for (i = 0, scale = 0; i < n; i++) s->prob[i] = (scale += w[i]);
+		return;
+	}
+	small = my_malloci(n,"alias worklist");
+	large = my_malloci(n,"alias worklist");
+	scale = n / s->total;
+	for (i = 0; i < n; i++) {
+		s->prob[i] = w[i] * scale;
+		if (s->prob[i] < 1) small[ns++] = i;
+		else large[nl++] = i;
+	}
+	while (ns && nl) {
+		i = small[--ns];
+		j = large[nl-1];
+		s->alias[i] = j;
+		s->prob[j] -= 1 - s->prob[i];
+		if (s->prob[j] < 1) { nl--; small[ns++] = j; }
+	}
+	/* whatever's left is 1 up to rounding */
+	while (nl) { j = large[--nl]; s->prob[j] = 1; s->alias[j] = j; }
+	while (ns) { i = small[--ns]; s->prob[i] = 1; s->alias[i] = i; }
+	my_free(small);
+	my_free(large);
+}
+
+static Sampler _sampler_new (dArray dist, int alias_kind) {
+	Sampler new = (Sampler)my_malloc(sizeof(struct sampler),"sampler");
+	if (dist->ndim != 1) die("Samplers need a 1-D distribution, not %d-D\n",dist->ndim);
+	new->n = dist->dim[0];
+	new->alias_kind = alias_kind;
+	new->prob = my_mallocd(new->n,"sampler table");
+	if (alias_kind) new->alias = my_malloci(new->n,"alias table");
+	_sampler_build(new,dist);
+	return new;
+}
+Sampler sampler_alias (dArray dist) { return _sampler_new(dist,1); }
+Sampler sampler_cdf (dArray dist) { return _sampler_new(dist,0); }
+
+/* new weights, same length */
+void sampler_reset (Sampler s, dArray dist) {
+	if (dist->ndim != 1 || dist->dim[0] != s->n)
+		die("Sampler has %d entries; can't reset it from a different shape\n",s->n);
+	_sampler_build(s,dist);
+}
+
+void sampler_free (Sampler s) {
+	my_free(s->prob);
+	if (s->alias) my_free(s->alias);
+	my_free(s);
+}
+
+static int _sample_cdf (Sampler s, double u) {
+	int lo = 0, hi = s->n - 1, mid;
+	u *= s->total;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->prob[mid] > u) hi = mid;
+		else lo = mid + 1;
+	}
+	return lo;
+}
+static int _sample_alias (Sampler s, double u) {
+	double x = u * s->n;
+	int i = (int)x;
+	return (x - i < s->prob[i]) ? i : s->alias[i];
+}
+
+int sample (Sampler s, Rng r) {
+	double u = rng_double(r);
+	return s->alias_kind ? _sample_alias(s,u) : _sample_cdf(s,u);
+}
+
+/* fills every entry of out */
+void sample_n (Sampler s, Rng r, iArray out) {
+	long k;
+	if (s->alias_kind)
+		for (k = 0; k < out->size; k++) out->data[k] = _sample_alias(s,rng_double(r));
+	else
+		for (k = 0; k < out->size; k++) out->data[k] = _sample_cdf(s,rng_double(r));
 }
-*/
 
 /* FORMULAE:
 
@@ -1024,68 +4282,516 @@ gam_t(i) =
 
 */
 
+/* HMM: sig[N] = start distribution, gam[N][N] = gam(next|prev) indexed
+ * [prev][next], eta[N][M] = eta(symbol|state), read from and written to
+ * the "sig"/"gam"/"eta" files. A sequence is an int array of symbols
+ * ("seq"). Forward-backward uses per-step scaling (Rabiner): alpha_t is
+ * kept normalized, scale[t] is what it summed to before that, and the
+ * log-likelihood is the sum of log(scale[t]). alpha is time-major
+ * (T rows of N), the only O(T) table; beta lives in two rows.
+ */
+HMM hmm_new (int N, int M) {
+	HMM new = (HMM)my_malloc(sizeof(struct hmm),"HMM");
+	new->N = N;
+	new->M = M;
+	new->sig = named("sig",initdArray(1,N));
+	new->gam = named("gam",initdArray(2,N,N));
+	new->eta = named("eta",initdArray(2,N,M));
+	return new;
+}
+void hmm_free (HMM h) {
+	free_dArr(h->sig);
+	free_dArr(h->gam);
+	free_dArr(h->eta);
+	if (h->etaT) my_free(h->etaT);
+	my_free(h);
+}
+void hmm_zero (HMM h) {
+	memset(h->sig->data,0,h->sig->size*sizeof(double));
+	memset(h->gam->data,0,h->gam->size*sizeof(double));
+	memset(h->eta->data,0,h->eta->size*sizeof(double));
+}
+
+/* copies a mapped parameter file into an ordinary array, so the file can
+ * be rewritten by hmm_save without pulling pages out from under us */
+static dArray _hmm_read (char *spec, int ndim) {
+	dArray m = map_dArray_spec(spec,MAP_ARR_RO), arr;
+	if (m->ndim != ndim) die("%s should have %d dimensions, not %d\n",spec,ndim,m->ndim);
+	arr = (ndim == 1) ? initdArray(1,m->dim[0]) : initdArray(2,m->dim[0],m->dim[1]);
+	memcpy(arr->data,m->data,m->size*sizeof(double));
+	free_dArr(m);
+	return named(spec,arr);
+}
+HMM hmm_load (void) {
+	HMM new = (HMM)my_malloc(sizeof(struct hmm),"HMM");
+	new->sig = _hmm_read("sig",1);
+	new->gam = _hmm_read("gam",2);
+	new->eta = _hmm_read("eta",2);
+	new->N = new->sig->dim[0];
+	new->M = new->eta->dim[1];
+	if (new->gam->dim[0] != new->N || new->gam->dim[1] != new->N)
+		die("gam is %dx%d, but sig has %d states\n",new->gam->dim[0],new->gam->dim[1],new->N);
+	if (new->eta->dim[0] != new->N)
+		die("eta has %d states, but sig has %d\n",new->eta->dim[0],new->N);
+	return new;
+}
+void hmm_save (HMM h) {
+	save_dArray(h->sig,get_filename("sig"));
+	save_dArray(h->gam,get_filename("gam"));
+	save_dArray(h->eta,get_filename("eta"));
+}
+
+/* eta transposed to [M][N], so one symbol's column is contiguous; call
+ * again after changing eta by hand (hmm_mstep does it itself) */
+void hmm_prepare (HMM h) {
+	int i, k;
+	if (!h->etaT) h->etaT = my_mallocd((size_t)h->M*h->N,"transposed eta");
+	for (i = 0; i < h->N; i++)
+		for (k = 0; k < h->M; k++)
+			h->etaT[(long)k*h->N+i] = h->eta->data[(long)i*h->M+k];
+}
+
+static void _hmm_check_seq (HMM h, int *seq, long T) {
+	long t;
+	for (t = 0; t < T; t++)
+		if (seq[t] < 0 || seq[t] >= h->M)
+			die("Symbol %d at position %ld is outside 0..%d\n",seq[t],t,h->M-1);
+}
+
+/* alpha[T*N] and scale[T] are filled in; returns the log-likelihood
+ * (-inf if the sequence is impossible under h) */
+double hmm_forward (HMM h, int *seq, long T, double *alpha, double *scale) {
+	int N = h->N, i, j;
+	double *a, *prev, *b, ll = 0;
+	long t;
+	if (!h->etaT) hmm_prepare(h);
+	_hmm_check_seq(h,seq,T);
+	for (t = 0; t < T; t++) {
+		a = alpha + t*N;
+		b = h->etaT + (long)seq[t]*N;
+		if (t == 0) {
+			for (j = 0; j < N; j++) a[j] = h->sig->data[j] * b[j];
+		} else {
+			prev = a - N;
+			memset(a,0,N*sizeof(double));
+			for (i = 0; i < N; i++)
+				if (prev[i]) vec_axpy(a,h->gam->data+(long)i*N,N,prev[i]);
+			for (j = 0; j < N; j++) a[j] *= b[j];
+		}
+		scale[t] = vec_normalize(a,N);
+		if (!scale[t]) return -HUGE_VAL;
+		ll += log(scale[t]);
+	}
+	return ll;
+}
+
+/* one sequence's E-step: expected start, transition and emission counts
+ * are added into acc (same shape as h); returns the log-likelihood, and
+ * adds nothing if the sequence is impossible */
+double hmm_estep (HMM h, int *seq, long T, HMM acc) {
+	int N = h->N, M = h->M, i, j, k;
+	double *alpha, *scale, *beta, *next, *tmp, *xi, *emit, *a, *b, *swap, ll;
+	long t;
+	if (T <= 0) return 0;
+	alpha = my_mallocd((size_t)T*N,"forward table");
+	scale = my_mallocd(T,"forward scale");
+	ll = hmm_forward(h,seq,T,alpha,scale);
+	if (isinf(ll)) {
+		my_free(alpha);
+		my_free(scale);
+		return ll;
+	}
+	beta = my_mallocd(N,"backward row");
+	next = my_mallocd(N,"backward row");
+	tmp = my_mallocd(N,"backward scratch");
+	xi = my_mallocd((size_t)N*N,"transition counts");
+	emit = my_mallocd((size_t)M*N,"emission counts");
+	for (j = 0; j < N; j++) next[j] = 1;
+	for (t = T-1; t >= 0; t--) {
+		a = alpha + t*N;
+		/* gamma_t(i) = alpha_t(i) beta_t(i); next holds beta_t here */
+		b = emit + (long)seq[t]*N;
+		for (i = 0; i < N; i++) b[i] += a[i] * next[i];
+		if (t == 0) {
+			for (i = 0; i < N; i++) acc->sig->data[i] += a[i] * next[i];
+			break;
+		}
+		/* tmp_j = eta(o_t|j) beta_t(j) / scale_t, shared by xi_{t-1}
+		 * and beta_{t-1}(i) = sum_j gam(j|i) tmp_j */
+		b = h->etaT + (long)seq[t]*N;
+		for (j = 0; j < N; j++) tmp[j] = b[j] * next[j] / scale[t];
+		a -= N;
+		for (i = 0; i < N; i++) {
+			if (a[i]) vec_axpy(xi+(long)i*N,tmp,N,a[i]);
+			beta[i] = vec_dot(h->gam->data+(long)i*N,tmp,N);
+		}
+		swap = beta; beta = next; next = swap;
+	}
+	/* xi was summed without the gam(j|i) factor common to every t */
+	for (i = 0; i < N; i++)
+		for (j = 0; j < N; j++)
+			acc->gam->data[(long)i*N+j] += h->gam->data[(long)i*N+j] * xi[(long)i*N+j];
+	for (k = 0; k < M; k++)
+		for (i = 0; i < N; i++)
+			acc->eta->data[(long)i*M+k] += emit[(long)k*N+i];
+	my_free(alpha);
+	my_free(scale);
+	my_free(beta);
+	my_free(next);
+	my_free(tmp);
+	my_free(xi);
+	my_free(emit);
+	return ll;
+}
+
+/* Viterbi in log space, checkpointed so memory is O(sqrt(T)*N) rather
+ * than a T*N backpointer table. The sequence is cut into segments of
+ * K ~ sqrt(T) steps. The first sweep keeps only the delta vector just
+ * before each segment. The second walks the segments backwards,
+ * recomputing each one's backpointers to find the state it ends in. The
+ * third recomputes them front to back and hands the path to the sink in
+ * order. So it costs three forward passes. delta is shifted to max 0
+ * every step, so it stays well inside double range for long sequences.
+ */
+struct _vit {
+	int N, *seq;
+	double *lsig, *lgam, *leta;
+};
+static double _vit_log (double p) { return p > 0 ? log(p) : -HUGE_VAL; }
+
+/* delta_t from delta_{t-1} (or the start if prev is NULL), with the
+ * winning predecessors in bp if given; returns the amount shifted off */
+static double _vit_step (struct _vit *v, double *prev, double *cur, int *bp, long t) {
+	int N = v->N, i, j;
+	double *row, *e = v->leta + (long)v->seq[t]*N, m = -HUGE_VAL, c;
+	if (!prev) {
+		for (j = 0; j < N; j++) cur[j] = v->lsig[j];
+	} else {
+		for (j = 0; j < N; j++) cur[j] = -HUGE_VAL;
+		for (i = 0; i < N; i++) {
+			if (prev[i] == -HUGE_VAL) continue;
+			row = v->lgam + (long)i*N;
+			for (j = 0; j < N; j++) {
+				c = prev[i] + row[j];
+				if (c > cur[j]) {
+					cur[j] = c;
+					if (bp) bp[j] = i;
+				}
+			}
+		}
+	}
+	for (j = 0; j < N; j++) {
+		cur[j] += e[j];
+		if (cur[j] > m) m = cur[j];
+	}
+	if (m != -HUGE_VAL) for (j = 0; j < N; j++) cur[j] -= m;
+	return m;
+}
+
+/* recomputes segment [t0,t1) from the delta before it, then backtracks
+ * from state s at t1-1 into path; returns the state at t0-1 */
+static int _vit_segment (struct _vit *v, double *before, long t0, long t1,
+		int s, int *bp, int *path, double *a, double *b) {
+	double *prev = before, *cur = a;
+	long t;
+	for (t = t0; t < t1; t++) {
+		_vit_step(v,t ? prev : NULL,cur,bp+(t-t0)*v->N,t);
+		prev = cur;
+		cur = (cur == a) ? b : a;
+	}
+	for (t = t1-1; t >= t0; t--) {
+		path[t-t0] = s;
+		if (t) s = bp[(t-t0)*v->N+s];
+	}
+	return s;
+}
+
+static double _viterbi (HMM h, int *seq, long T,
+		void (*sink)(int *states, long n, void *arg), void *arg) {
+	struct _vit v;
+	int N = h->N, i, k, s, *bp, *path, *ends;
+	long K, nseg, c, t, t1;
+	double *ckpt, *a, *b, *swap, m, ll = 0;
+	if (T <= 0) return 0;
+	_hmm_check_seq(h,seq,T);
+	for (K = 1; K*K < T; K++);
+	nseg = (T + K - 1) / K;
+	v.N = N;
+	v.seq = seq;
+	v.lsig = my_mallocd(N,"log start");
+	v.lgam = my_mallocd((size_t)N*N,"log transitions");
+	v.leta = my_mallocd((size_t)h->M*N,"log emissions");
+	for (i = 0; i < N; i++) v.lsig[i] = _vit_log(h->sig->data[i]);
+	for (i = 0; i < N*N; i++) v.lgam[i] = _vit_log(h->gam->data[i]);
+	for (i = 0; i < N; i++)
+		for (k = 0; k < h->M; k++)
+			v.leta[(long)k*N+i] = _vit_log(h->eta->data[(long)i*h->M+k]);
+	ckpt = my_mallocd((size_t)nseg*N,"viterbi checkpoints");
+	a = my_mallocd(N,"viterbi row");
+	b = my_mallocd(N,"viterbi row");
+	bp = my_malloci((size_t)K*N,"viterbi backpointers");
+	path = my_malloci(K,"viterbi path");
+	ends = my_malloci(nseg,"viterbi segment ends");
+	/* sweep 1: checkpoint c holds delta_{cK-1} */
+	for (t = 0; t < T; t++) {
+		m = _vit_step(&v,t ? b : NULL,a,NULL,t);
+		if (m == -HUGE_VAL) { ll = m; break; }
+		ll += m;
+		if ((t+1) % K == 0 && t+1 < T)
+			memcpy(ckpt+((t+1)/K)*N,a,N*sizeof(double));
+		swap = a; a = b; b = swap;
+	}
+	if (ll != -HUGE_VAL) {
+		/* delta_{T-1} is in b, and its best state has been shifted to 0 */
+		for (s = 0, i = 1; i < N; i++) if (b[i] > b[s]) s = i;
+		ends[nseg-1] = s;
+		/* sweep 2: where each segment ends, from the back */
+		for (c = nseg-1; c > 0; c--) {
+			t1 = (c+1)*K < T ? (c+1)*K : T;
+			ends[c-1] = _vit_segment(&v,ckpt+c*N,c*K,t1,ends[c],bp,path,a,b);
+		}
+		/* sweep 3: the path itself, front to back */
+		for (c = 0; c < nseg; c++) {
+			t1 = (c+1)*K < T ? (c+1)*K : T;
+			_vit_segment(&v,ckpt+c*N,c*K,t1,ends[c],bp,path,a,b);
+			sink(path,t1-c*K,arg);
+		}
+	}
+	my_free(v.lsig);
+	my_free(v.lgam);
+	my_free(v.leta);
+	my_free(ckpt);
+	my_free(a);
+	my_free(b);
+	my_free(bp);
+	my_free(path);
+	my_free(ends);
+	return ll;
+}
+
+static void _vit_to_array (int *states, long n, void *arg) {
+	int **at = (int **)arg;
+	memcpy(*at,states,n*sizeof(int));
+	*at += n;
+}
+static void _vit_to_output (int *states, long n, void *arg) {
+	(void)arg;
+	writeia(states,n);
+}
+
+/* most likely state path for seq into path[T]; returns its log
+ * probability (-inf, with path untouched, if seq is impossible) */
+double hmm_viterbi (HMM h, int *seq, long T, int *path) {
+	return _viterbi(h,seq,T,_vit_to_array,&path);
+}
+/* same, but the path goes to the selected output as binary ints
+ * (writeia), a segment at a time */
+double hmm_viterbi_write (HMM h, int *seq, long T) {
+	return _viterbi(h,seq,T,_vit_to_output,NULL);
+}
+
+/* new parameters from expected counts; a row with no counts keeps its
+ * old values instead of going to zero */
+static void _hmm_renorm (dArray to, dArray from) {
+	long r, len = to->dim[to->ndim-1];
+	double s;
+	for (r = 0; r < to->size; r += len) {
+		s = vec_sum(from->data+r,len);
+		if (!s) continue;
+		memcpy(to->data+r,from->data+r,len*sizeof(double));
+		vec_scale(to->data+r,len,1.0/s);
+	}
+}
+void hmm_mstep (HMM h, HMM acc) {
+	_hmm_renorm(h->sig,acc->sig);
+	_hmm_renorm(h->gam,acc->gam);
+	_hmm_renorm(h->eta,acc->eta);
+	hmm_prepare(h);
+}
+
+/* the E-step for many sequences across myc_pool(). Sequences are dealt
+ * out longest-first to the least-loaded thread, each thread sums into
+ * its own accumulator, and the accumulators are merged pairwise in a
+ * fixed tree, so for a given thread count the result doesn't depend on
+ * scheduling. Counts are added into acc; returns the total
+ * log-likelihood. */
+struct _estep_job {
+	HMM h, *part;
+	iArray *seqs;
+	int n, nseq, *owner, *order, step;
+	double *ll;
+};
+static void _estep_worker (void *v, int id) {
+	struct _estep_job *j = (struct _estep_job *)v;
+	int k, s;
+	hmm_zero(j->part[id]);
+	j->ll[id] = 0;
+	for (k = 0; k < j->nseq; k++) {
+		s = j->order[k];
+		if (j->owner[s] == id)
+			j->ll[id] += hmm_estep(j->h,j->seqs[s]->data,j->seqs[s]->size,j->part[id]);
+	}
+}
+static void _hmm_add (HMM to, HMM from) {
+	vec_axpy(to->sig->data,from->sig->data,to->sig->size,1.0);
+	vec_axpy(to->gam->data,from->gam->data,to->gam->size,1.0);
+	vec_axpy(to->eta->data,from->eta->data,to->eta->size,1.0);
+}
+static void _merge_worker (void *v, int id) {
+	struct _estep_job *j = (struct _estep_job *)v;
+	if (id % (2*j->step) || id + j->step >= j->n) return;
+	_hmm_add(j->part[id],j->part[id+j->step]);
+	j->ll[id] += j->ll[id+j->step];
+}
+struct _seqlen { long len; int idx; };
+static int _by_length (const void *a, const void *b) {
+	const struct _seqlen *x = (const struct _seqlen *)a, *y = (const struct _seqlen *)b;
+	if (x->len != y->len) return x->len > y->len ? -1 : 1;
+	return x->idx - y->idx;
+}
+double hmm_estep_all (HMM h, iArray *seqs, int nseq, HMM acc) {
+	TPool pool = myc_pool();
+	struct _estep_job j;
+	int n = tpool_size(pool), k, t, best;
+	struct _seqlen *byl;
+	long *load;
+	double ll;
+	if (n == 1) {
+		for (ll = 0, k = 0; k < nseq; k++)
+			ll += hmm_estep(h,seqs[k]->data,seqs[k]->size,acc);
+		return ll;
+	}
+	if (!h->etaT) hmm_prepare(h);
+	j.h = h;
+	j.n = n;
+	j.seqs = seqs;
+	j.nseq = nseq;
+	j.order = my_malloci(nseq,"sequence order");
+	j.owner = my_malloci(nseq,"sequence owners");
+	j.ll = my_mallocd(n,"per-thread likelihood");
+	j.part = (HMM *)my_malloc(n*sizeof(HMM),"per-thread counts");
+	load = (long *)my_malloc(n*sizeof(long),"per-thread load");
+	byl = (struct _seqlen *)my_malloc(nseq*sizeof(struct _seqlen),"sequence lengths");
+	for (k = 0; k < nseq; k++) {
+		byl[k].len = seqs[k]->size;
+		byl[k].idx = k;
+	}
+	qsort(byl,nseq,sizeof(struct _seqlen),_by_length);
+	for (k = 0; k < nseq; k++) j.order[k] = byl[k].idx;
+	my_free(byl);
+	for (k = 0; k < nseq; k++) {
+		for (best = 0, t = 1; t < n; t++) if (load[t] < load[best]) best = t;
+		j.owner[j.order[k]] = best;
+		load[best] += seqs[j.order[k]]->size;
+	}
+	for (t = 0; t < n; t++) j.part[t] = hmm_new(h->N,h->M);
+	tpool_run(pool,_estep_worker,&j);
+	for (j.step = 1; j.step < n; j.step *= 2) tpool_run(pool,_merge_worker,&j);
+	_hmm_add(acc,j.part[0]);
+	ll = j.ll[0];
+	for (t = 0; t < n; t++) hmm_free(j.part[t]);
+	my_free(j.order);
+	my_free(j.owner);
+	my_free(j.ll);
+	my_free(j.part);
+	my_free(load);
+	return ll;
+}
+
+/* up to iters rounds of EM over nseq sequences, stopping early once the
+ * total log-likelihood improves by less than tol; returns the last one */
+double baum_welch (HMM h, iArray *seqs, int nseq, int iters, double tol) {
+	HMM acc = hmm_new(h->N,h->M);
+	double ll = -HUGE_VAL, prev;
+	int it;
+	hmm_prepare(h);
+	for (it = 0; it < iters; it++) {
+		prev = ll;
+		hmm_zero(acc);
+		ll = hmm_estep_all(h,seqs,nseq,acc);
+		hmm_mstep(h,acc);
+		if (verbose) warnq("Baum-Welch iteration %d: log-likelihood %.*f\n",
+			it+1,float_precision,ll);
+		if (it && ll - prev < tol) break;
+	}
+	hmm_free(acc);
+	return ll;
+}
+
 void default_file (char **filename, char *base, char *specific) {
-	int i, nl, l = 0;
 	char *template = "%s-%s.bin";
 	if (filename && *filename) return;
 	if (!base) die("BASE=%s filename=%s specific=%s\n",base,*filename,specific);
 	if (!base) die("Must specify base=(prefix) or %s=(filename)\n",specific);
-	l = strlen(template);
-	nl = l;
-	for (i = 0; i < l; i++) if (template[i]=='%') nl -= 2;
-	nl += strlen(base);
-	nl += strlen(specific);
-	*filename = my_mallocc(nl+1,"filename");
-	sprintf(*filename,template,base,specific);
+	sb_reset(&scratch);
+	sb_appendf(&scratch,template,base,specific);
+	*filename = sb_dup(&scratch);
 	warnq("%s filename defaulted to %s\n",specific,*filename);
 }
 
-/*
+/* one draw from dist (normalized in place); for many draws from the same
+ * weights, build a Sampler instead */
 int pick_from_dist (dArray dist) {
 	int i;
 	double d, tot;
-	normalizeBut1(dist);
+	vec_normalize(dist->data,dist->size);
 	if (verbose > 3) printdArray(dist);
 	d = random_number();
 	if (verbose > 2) warn("DRAND{%.*f}\n",float_precision,d);
 	for (i = 0, tot = 0; i < dist->dim[0]; i++) {
-		tot += dGet(dist,i);
-		if (tot >= d) break;
+		tot += dist->data[i];
+		if (tot > d) break;
 	}
 	if (i==dist->dim[0]) i = dist->dim[0] - 1;
 	return i;
 }
-*/
-
-typedef struct _printfuncs {
-	void(*String)(char *s);
-	void(*Index)(int i);
-	void(*I)(int i);
-	void(*D)(double d);
-	void(*NL)(void);
-	void(*SP)(void);
-	void(*TAB)(void);
-} printfuncs;
 
 void with_outfile (void(*func)(void)) {
 	int selected = selected_fd;
 	char *fn = get_filename_nod("out");
-	if (fn) selected_fd = my_openout(fn);
+	if (fn) my_select(my_openout(fn));
 	func();
-	if (fn) close(selected_fd);
-	selected_fd = selected;
+	if (fn) my_close(selected_fd);
+	my_select(selected);
 	set_filename("out",NULL);
 }
 
-void _printString_txt (char *s) { dprintf(selected_fd,"%s",s); }
+void _printString_txt (char *s) { writes(s); }
 void _printIndex_txt (int i) { }
-void _printI_txt (int i) { dprintf(selected_fd,"%d",i); }
+/* numbers are formatted straight into the selected fd's write buffer
+ * (no per-token copy), and rows go in one pass */
+void _printI_txt (int i) {
+	WriteBuf b = _writespace(selected_fd,FMT_MAX);
+	b->fill += fmt_ll(b->buf+b->fill,i);
+}
 void _printD_txt (double d) {
-	dprintf(selected_fd,"%.*f",(float_precision>2)?float_precision:7,d);
+	WriteBuf b = _writespace(selected_fd,FMT_MAX);
+	b->fill += fmt_fixed(b->buf+b->fill,d,(float_precision>2)?float_precision:7);
+}
+void _printNL_txt (void) { _writebytes(selected_fd,"\n",1); }
+void _printSP_txt (void) { _writebytes(selected_fd," ",1); }
+void _printTAB_txt (void) { _writebytes(selected_fd,"\t",1); }
+void _printDRow_txt (double *d, long n) {
+	int prec = (float_precision>2)?float_precision:7;
+	WriteBuf b;
+	long i;
+	for (i = 0; i < n; i++) {
+		b = _writespace(selected_fd,FMT_MAX+1);
+		if (i) b->buf[b->fill++] = ' ';
+		b->fill += fmt_fixed(b->buf+b->fill,d[i],prec);
+	}
+	_printNL_txt();
+}
+void _printIRow_txt (int *d, long n) {
+	WriteBuf b;
+	long i;
+	for (i = 0; i < n; i++) {
+		b = _writespace(selected_fd,FMT_MAX+1);
+		if (i) b->buf[b->fill++] = ' ';
+		b->fill += fmt_ll(b->buf+b->fill,d[i]);
+	}
+	_printNL_txt();
 }
-void _printNL_txt (void) { dprintf(selected_fd,"\n"); }
-void _printSP_txt (void) { dprintf(selected_fd," "); }
-void _printTAB_txt (void) { dprintf(selected_fd,"\t"); }
 static printfuncs pf_txt = {
 	_printString_txt,
 	_printIndex_txt,
@@ -1093,7 +4799,9 @@ static printfuncs pf_txt = {
 	_printD_txt,
 	_printNL_txt,
 	_printSP_txt,
-	_printTAB_txt
+	_printTAB_txt,
+	_printDRow_txt,
+	_printIRow_txt
 };
 
 void _printString_bin (char *s) { int l = strlen(s); writei(l); writes(s); }
@@ -1107,16 +4815,40 @@ static printfuncs pf_bin = {
 	writed,
 	_printNL_bin,
 	_printSP_bin,
-	_printTAB_bin
+	_printTAB_bin,
+	writeda,
+	writeia
 };
+
+/* "txt" or "bin", for wherever a backend gets chosen ("stream" is an
+ * old name for txt) */
+printfuncs *pf_named (char *name) {
+	if (is(name,"txt")) return &pf_txt;
+	if (is(name,"bin")) return &pf_bin;
+	die("Unknown output format: %s\n",name);
+	return NULL;
+}
 #warning - following code is just to get rid of more warnings
 void _use_it (printfuncs pf, int i) { pf.I(i); }
 void _use_txt (void) { _use_it(pf_txt, 10); }
 void _use_bin (void) { _use_it(pf_bin, 10); }
 
-void _print_dims (dArray arr, printfuncs pf) {
+static void _print_dimv (int ndim, int *dim, printfuncs *pf) {
 	int i;
-	for (i = 0; i < arr->ndim; i++) pf.Index(arr->dim[i]);
+	for (i = 0; i < ndim; i++) pf->Index(dim[i]);
+}
+void _print_dims (dArray arr, printfuncs pf) { _print_dimv(arr->ndim,arr->dim,&pf); }
+
+/* dims (binary only), then one DRow/IRow per run along the last axis */
+void emit_dArray (dArray arr, printfuncs *pf) {
+	long r, len = arr->ndim ? arr->dim[arr->ndim-1] : 1;
+	_print_dimv(arr->ndim,arr->dim,pf);
+	for (r = 0; r < arr->size; r += len) pf->DRow(arr->data+r,len);
+}
+void emit_iArray (iArray arr, printfuncs *pf) {
+	long r, len = arr->ndim ? arr->dim[arr->ndim-1] : 1;
+	_print_dimv(arr->ndim,arr->dim,pf);
+	for (r = 0; r < arr->size; r += len) pf->IRow(arr->data+r,len);
 }
 
 void consume_filename (void) { set_filename("out",fifo_pop(output_files)); }
@@ -1127,9 +4859,12 @@ void with_outfile_named (char *outfn, void (*func)(void)) {
 }
 
 char *filename_from_base (char *base, char *type, char *ext) {
-	char *ret = my_mallocc(strlen(base)+2+strlen(type)+strlen(ext),"filename");
-	sprintf(ret,"%s-%s%s",base,type,ext);
-	return ret;
+	sb_reset(&scratch);
+	sb_append(&scratch,base);
+	sb_appendc(&scratch,'-');
+	sb_append(&scratch,type);
+	sb_append(&scratch,ext);
+	return sb_dup(&scratch);
 }
 
 void print_fifo (FIFO fifo) {
@@ -1144,8 +4879,4 @@ double time_to_double (struct timeval t) {
 	return t.tv_sec + ((double)t.tv_usec/1000000);
 }
 
-double NOW (void) {
-	struct timeval now;
-	if (gettimeofday(&now,NULL)) return 0.0;
-	return time_to_double(now);
-}
+double NOW (void) { return wallclock(); }
@@ -22,6 +22,7 @@ extern int float_precision;
 extern double program_start;
 extern long seed, use_seed;
 extern int myc_debug_malloc;
+extern int myc_threads;
 
 void initialize_globals (void);
 void warn (const char *fmt, ...);
@@ -35,13 +36,86 @@ int *my_malloci (size_t n, char *what);
 double *my_mallocd (size_t n, char *what);
 char *my_mallocc (size_t n, char *what);
 
+typedef struct arena *Arena;
+typedef struct { void *chunk; size_t used; } ArenaMark;
+Arena arena_new (size_t chunk);
+void *arena_alloc (Arena a, size_t n);
+void *arena_alloc_aligned (Arena a, size_t n, size_t align);
+ArenaMark arena_mark (Arena a);
+void arena_rollback (Arena a, ArenaMark m);
+void arena_reset (Arena a);
+void arena_free (Arena a);
+Arena use_arena (Arena a);
+
+typedef struct pool *Pool;
+Pool pool_new (size_t size, char *what);
+Pool pool_new_shared (size_t size, char *what);
+void *pool_get (Pool p);
+void pool_put (Pool p, void *obj);
+void pool_free (Pool p);
+void *pool_malloc (size_t n, char *what);
+void pool_release (void *obj, size_t n);
+
 char *my_strcpy (char *orig);
 char *my_sprintf (const char *fmt, ...);
 
+typedef struct strbuf { char *s; size_t len; size_t cap; Arena arena; } *StrBuf;
+StrBuf sb_new (size_t cap);
+StrBuf sb_new_arena (Arena a, size_t cap);
+void sb_free (StrBuf b);
+void sb_reset (StrBuf b);
+void sb_append (StrBuf b, const char *p);
+void sb_appendn (StrBuf b, const char *p, size_t n);
+void sb_appendc (StrBuf b, char c);
+void sb_appendf (StrBuf b, const char *fmt, ...);
+void sb_vappendf (StrBuf b, const char *fmt, va_list s);
+char *sb_dup (StrBuf b);
+
+#define FMT_PREC_MAX 64 // fmt_fixed clamps to this many places...
+#define FMT_MAX 384 // ...so sign + 309 digits + '.' + places + NUL always fits
+int fmt_ull (char *buf, unsigned long long v);
+int fmt_ll (char *buf, long long v);
+int fmt_fixed (char *buf, double d, int prec);
+int fmt_double (char *buf, double d);
+long long parse_ll (const char *s, char **end);
+double parse_d (const char *s, char **end);
+
 char *ltoa (long in);
 char *lltoa (long long in);
 int int_free (char *tmp);
 
+typedef struct strview { char *s; size_t len; } StrView;
+StrView sv (char *s);
+StrView sv_n (char *s, size_t len);
+char *str_find (char *s, int c);
+long sv_find (StrView v, int c);
+int sv_is (StrView v, char *s);
+int sv_starts (StrView v, StrView with);
+int sv_ends (StrView v, StrView with);
+StrView sv_split (StrView *rest, int delim);
+int sv_kv (StrView v, StrView *key, StrView *val);
+int str_kv (char *s, StrView *key, StrView *val);
+char *str_after (char *s, char *prefix);
+char *sv_dup (StrView v);
+
+typedef struct hashmap *HashMap;
+typedef union { void *p; long i; } HMVal;
+HashMap hm_new (size_t n);
+void hm_free (HashMap m);
+size_t hm_len (HashMap m);
+HMVal *hm_find (HashMap m, char *key, size_t len);
+HMVal *hm_ref (HashMap m, char *key, size_t len);
+char *hm_key (HashMap m, char *key, size_t len);
+int hm_del (HashMap m, char *key, size_t len);
+int hm_next (HashMap m, size_t *it, char **key, HMVal **val);
+void *hm_get (HashMap m, char *key);
+void hm_put (HashMap m, char *key, void *val);
+long hm_geti (HashMap m, char *key, long missing);
+void hm_puti (HashMap m, char *key, long val);
+char *intern (char *s);
+char *intern_n (char *s, size_t len);
+char *sv_intern (StrView v);
+
 char *argval (char *opt);
 int starts_with (char *string, char *with);
 int ends_with (char *string, char *with);
@@ -53,27 +127,297 @@ int my_open_warn (char *file);
 int my_openout (char *file);
 
 int my_select (int newfd);
+int my_close (int fd);
+void my_flush (int fd);
+void my_flush_all (void);
+void my_bufsize (int fd, size_t size);
 
 int readi (int fd, int *dest);
 int readl (int fd, long *dest);
 int readll (int fd, long long *dest);
 int readd (int fd, double *dest);
 int readslen (int fd, char **dest);
+long readia (int fd, int *dest, long n);
+long readda (int fd, double *dest, long n);
 void writei (int i);
 void writel (long l);
 void writell (long long ll);
 void writed (double d);
 void writes (char *s);
 void writeslen (char *s);
+void writeia (int *a, long n);
+void writeda (double *a, long n);
+void writebytes (const void *p, size_t n);
+
+typedef struct _fifo *FIFO;
+FIFO fifo_new (void);
+int fifo_len (FIFO fifo);
+void fifo_push (FIFO fifo, char *str);
+char *fifo_pop (FIFO fifo);
+
+typedef struct mpmc *MPMC;
+MPMC mpmc_new (size_t cap);
+void mpmc_free (MPMC q);
+int mpmc_push (MPMC q, char *val);
+int mpmc_pop (MPMC q, char **dest);
+long mpmc_push_n (MPMC q, char **vals, long n);
+long mpmc_pop_n (MPMC q, char **dest, long n);
+long mpmc_len (MPMC q);
+long mpmc_cap (MPMC q);
+
+
+/* Arrays are row-major; stride[] and size are filled in when the array is
+ * created, so the fixed-arity accessors below are plain index arithmetic.
+ * map/maplen are only set for arrays backed by an mmap'd file.
+ */
+typedef struct d_array {
+	char *name; int ndim; int *dim; double *data;
+	void *map; size_t maplen;
+	long *stride; long size;
+} *dArray;
+typedef struct i_array {
+	char *name; int ndim; int *dim; int *data;
+	void *map; size_t maplen;
+	long *stride; long size;
+} *iArray;
+
+dArray initdArray (int ndim, ...);
+iArray initiArray (int ndim, ...);
+dArray named (char *name, dArray arr);
+iArray namei (char *name, iArray arr);
+double dGet (dArray arr, ...);
+double dSet (dArray arr, ...);
+double dInc (dArray arr, ...);
+int iGet (iArray arr, ...);
+int iSet (iArray arr, ...);
+double dGetP (dArray arr, int *d);
+double dSetP (dArray arr, int *d, double v);
+int iGetP (iArray arr, int *d);
+int iSetP (iArray arr, int *d, int v);
+double *dSliceP (dArray arr, int nfix, int *idx);
+int *iSliceP (iArray arr, int nfix, int *idx);
+void printdArray (dArray arr);
+void printiArray (iArray arr);
+
+#define _D1(A,I)     ((A)->data[(I)])
+#define _D2(A,I,J)   ((A)->data[(I)*(A)->stride[0]+(J)])
+#define _D3(A,I,J,K) ((A)->data[(I)*(A)->stride[0]+(J)*(A)->stride[1]+(K)])
+static inline double dGet1 (dArray a, int i) { return _D1(a,i); }
+static inline double dGet2 (dArray a, int i, int j) { return _D2(a,i,j); }
+static inline double dGet3 (dArray a, int i, int j, int k) {
+	return _D3(a,i,j,k);
+}
+/* like dSet/dInc, these return the previous value */
+static inline double dSet1 (dArray a, int i, double v) {
+	double p = _D1(a,i); _D1(a,i) = v; return p;
+}
+static inline double dSet2 (dArray a, int i, int j, double v) {
+	double p = _D2(a,i,j); _D2(a,i,j) = v; return p;
+}
+static inline double dSet3 (dArray a, int i, int j, int k, double v) {
+	double p = _D3(a,i,j,k); _D3(a,i,j,k) = v; return p;
+}
+static inline double dInc1 (dArray a, int i, double v) {
+	double p = _D1(a,i); _D1(a,i) += v; return p;
+}
+static inline double dInc2 (dArray a, int i, int j, double v) {
+	double p = _D2(a,i,j); _D2(a,i,j) += v; return p;
+}
+static inline double dInc3 (dArray a, int i, int j, int k, double v) {
+	double p = _D3(a,i,j,k); _D3(a,i,j,k) += v; return p;
+}
+static inline int iGet1 (iArray a, int i) { return _D1(a,i); }
+static inline int iGet2 (iArray a, int i, int j) { return _D2(a,i,j); }
+static inline int iGet3 (iArray a, int i, int j, int k) {
+	return _D3(a,i,j,k);
+}
+static inline int iSet1 (iArray a, int i, int v) {
+	int p = _D1(a,i); _D1(a,i) = v; return p;
+}
+static inline int iSet2 (iArray a, int i, int j, int v) {
+	int p = _D2(a,i,j); _D2(a,i,j) = v; return p;
+}
+static inline int iSet3 (iArray a, int i, int j, int k, int v) {
+	int p = _D3(a,i,j,k); _D3(a,i,j,k) = v; return p;
+}
+static inline int iInc1 (iArray a, int i, int v) {
+	int p = _D1(a,i); _D1(a,i) += v; return p;
+}
+static inline int iInc2 (iArray a, int i, int j, int v) {
+	int p = _D2(a,i,j); _D2(a,i,j) += v; return p;
+}
+static inline int iInc3 (iArray a, int i, int j, int k, int v) {
+	int p = _D3(a,i,j,k); _D3(a,i,j,k) += v; return p;
+}
+/* contiguous rows: a[i][*] and (3-D) a[i][j][*] */
+static inline double *dRow (dArray a, int i) { return &_D2(a,i,0); }
+static inline double *dRow2 (dArray a, int i, int j) { return &_D3(a,i,j,0); }
+static inline int *iRow (iArray a, int i) { return &_D2(a,i,0); }
+static inline int *iRow2 (iArray a, int i, int j) { return &_D3(a,i,j,0); }
+
+/* modes for map_dArray/map_iArray */
+#define MAP_ARR_RO 0      // shared, read-only: safe for concurrent readers
+#define MAP_ARR_RW 1      // shared, read-write: sync_*Array writes it back
+#define MAP_ARR_PRIVATE 2 // copy-on-write: changes never reach the file
+
+void save_dArray (dArray arr, char *file);
+void save_iArray (iArray arr, char *file);
+dArray map_dArray (char *file, int mode);
+iArray map_iArray (char *file, int mode);
+dArray map_dArray_spec (char *spec, int mode);
+iArray map_iArray_spec (char *spec, int mode);
+dArray create_mapped_dArray (char *file, int ndim, ...);
+iArray create_mapped_iArray (char *file, int ndim, ...);
+void sync_dArray (dArray arr);
+void sync_iArray (iArray arr);
+void free_dArr (dArray arr);
+void free_iArr (iArray arr);
+
+/* sparse double arrays: just the nonzeros, packed in off[]/val[] (see
+ * libmyc.c); the index behind them is private */
+typedef struct sd_array {
+	char *name; int ndim; int *dim;
+	long *stride; long size;
+	long n, cap; long *off; double *val;
+	struct sd_slot *slot; size_t mask; int shift;
+} *sdArray;
+sdArray initsdArray (int ndim, ...);
+sdArray namesd (char *name, sdArray arr);
+void free_sdArr (sdArray arr);
+void sdClear (sdArray arr);
+double sdGet (sdArray arr, ...);
+double sdSet (sdArray arr, ...);
+double sdInc (sdArray arr, ...);
+double sdGetP (sdArray arr, int *d);
+double sdSetP (sdArray arr, int *d, double v);
+double sdIncP (sdArray arr, int *d, double v);
+double sdGetOff (sdArray arr, long off);
+double sdSetOff (sdArray arr, long off, double v);
+double sdIncOff (sdArray arr, long off, double v);
+void sdCoords (sdArray arr, long off, int *d);
+void sdSort (sdArray arr);
+sdArray sparse_dArray (dArray arr);
+dArray dense_sdArray (sdArray arr);
+
+/* fixed-size thread pools */
+typedef struct tpool *TPool;
+TPool tpool_new (int n);
+void tpool_run (TPool p, void (*fn)(void *arg, int id), void *arg);
+int tpool_size (TPool p);
+void tpool_free (TPool p);
+int myc_nthreads (void);
+TPool myc_pool (void);
+
+/* PAR_CHUNK = elements per chunk for the parallel array ops */
+#define PAR_CHUNK 65536
+void parallel_for (long lo, long hi, long grain,
+	void (*fn)(void *arg, long a, long b), void *arg);
+void par_zero (void *p, size_t n);
+
+/* vector kernels over contiguous doubles, dispatched by CPU */
+#define VEC_AUTO   -1
+#define VEC_SCALAR  0
+#define VEC_SSE2    1
+#define VEC_AVX2    2
+int vec_select (int level);
+double vec_sum (const double *x, long n);
+void vec_scale (double *x, long n, double a);
+void vec_axpy (double *y, const double *x, long n, double a);
+double vec_max (const double *x, long n);
+double vec_dot (const double *x, const double *y, long n);
+double vec_normalize (double *x, long n);
+double vec_logsumexp (const double *x, long n);
+double dSum (dArray arr);
+void dScale (dArray arr, double a);
+void dAxpy (dArray y, double a, dArray x);
+double dMax (dArray arr);
+double dDot (dArray x, dArray y);
+double dLogSumExp (dArray arr);
+void dFill (dArray arr, double v);
+void dMap (dArray arr, double (*f)(double));
+void iFill (iArray arr, int v);
+void iMap (iArray arr, int (*f)(int));
+void dNormalizeLast (dArray arr);
+double normalizeBut1 (dArray arr, ...);
+
+/* hidden Markov models over the sig/gam/eta files */
+typedef struct hmm {
+	int N, M;
+	dArray sig, gam, eta;
+	double *etaT;
+} *HMM;
+HMM hmm_new (int N, int M);
+HMM hmm_load (void);
+void hmm_save (HMM h);
+void hmm_free (HMM h);
+void hmm_zero (HMM h);
+void hmm_prepare (HMM h);
+double hmm_forward (HMM h, int *seq, long T, double *alpha, double *scale);
+double hmm_estep (HMM h, int *seq, long T, HMM acc);
+double hmm_estep_all (HMM h, iArray *seqs, int nseq, HMM acc);
+void hmm_mstep (HMM h, HMM acc);
+double hmm_viterbi (HMM h, int *seq, long T, int *path);
+double hmm_viterbi_write (HMM h, int *seq, long T);
+double baum_welch (HMM h, iArray *seqs, int nseq, int iters, double tol);
+
+/* output backends: pf_named("txt") or ("bin"). Both are buffered: txt
+ * formats numbers straight into the output's write buffer, so there's
+ * no separate streaming backend */
+typedef struct _printfuncs {
+	void(*String)(char *s);
+	void(*Index)(int i);
+	void(*I)(int i);
+	void(*D)(double d);
+	void(*NL)(void);
+	void(*SP)(void);
+	void(*TAB)(void);
+	void(*DRow)(double *d, long n);
+	void(*IRow)(int *i, long n);
+} printfuncs;
+printfuncs *pf_named (char *name);
+void emit_dArray (dArray arr, printfuncs *pf);
+void emit_iArray (iArray arr, printfuncs *pf);
 
 double now (void);
+long long now_ns (void);
+double wallclock (void);
+unsigned long long ticks (void);
+double ticks_per_sec (void);
+double ticks_to_sec (unsigned long long t);
+
+typedef struct region *Region;
+#define REGION_NONE 0
+#define REGION_TEXT 1
+#define REGION_CSV 2
+#define REGION_JSON 3
+extern int region_format;
+Region region_new (char *name);
+unsigned long long region_begin (void);
+void region_end (Region r, unsigned long long start);
+void region_report (int format);
+#define REGION_BEGIN(tag) \
+	static Region _region_##tag; \
+	unsigned long long _region_t0_##tag = (_region_##tag ? 0 : \
+		(_region_##tag = region_new(#tag), 0), region_begin())
+#define REGION_END(tag) region_end(_region_##tag,_region_t0_##tag)
 
 typedef struct counter *Counter;
 Counter gen_counter (char *arg, ...);
 void dump_counter (Counter c);
 void count (Counter c);
 void count_inc (Counter c, long long inc);
+/* the calling thread's slot in a threaded counter: count_local is then a
+ * plain add, with no lock prefix and no thread-local lookup. Only the
+ * thread that called count_slot may count_local into it. */
+typedef long long *CountSlot;
+CountSlot count_slot (Counter c);
+static inline void count_local (CountSlot s, long long n) {
+	__atomic_store_n(s,__atomic_load_n(s,__ATOMIC_RELAXED) + n,__ATOMIC_RELAXED);
+}
 void finish (Counter c);
+void free_counter (Counter c);
+void parallel_for_count (long lo, long hi, long grain,
+	void (*fn)(void *arg, long a, long b), void *arg, Counter c);
 void without_counters(void(*func)(void));
 
 char *get_optpart (char *arg);
@@ -83,6 +427,7 @@ double    get_next_argpd  (char ***argv, char *arg);
 long      get_next_argpl  (char ***argv, char *arg);
 long long get_next_argpll (char ***argv, char *arg);
 int       get_next_argpi  (char ***argv, char *arg);
+int       get_threads_argp (char ***argv, char *arg);
 
 char *    get_next_arg   (va_list *t, char *opt);
 double    get_next_argd  (va_list *t, char *opt);
@@ -90,8 +435,61 @@ long long get_next_argll (va_list *t, char *opt);
 long      get_next_argl  (va_list *t, char *opt);
 int       get_next_argi  (va_list *t, char *opt);
 
+/* table-driven options: see opt_compile */
+#include <stddef.h> // for offsetof
+#define OPT_FLAG   0
+#define OPT_INT    1
+#define OPT_LONG   2
+#define OPT_LLONG  3
+#define OPT_DOUBLE 4
+#define OPT_STR    5
+#define OPT_TYPE   15
+#define OPT_PREFIX 16 // matches any option starting with the name
+#define OPT_LAX    32 // numbers parse like atol/atof: junk is 0, not an error
+typedef struct optspec {
+	char *name;
+	int type;
+	void *dest;
+	size_t off;
+	long val;
+} OptSpec;
+#define OPT_FIELD(type,field) NULL, offsetof(type,field)
+typedef struct opttable *OptTable;
+OptTable opt_compile (OptSpec *specs);
+void opt_free (OptTable t);
+OptSpec *opt_find (OptTable t, const char *arg);
+int opt_parse_argv (OptTable t, void *base, char ***argv);
+int opt_parse_va (OptTable t, void *base, char *arg, va_list *s);
+char *opt_suggest (OptTable t, const char *arg);
+void opt_unknown (OptTable t, char *what, char *arg);
+
+/* xoshiro256++ generators; rng_default() is per-thread, numbered in
+ * first-call order; use rng_stream or rng_thread for reproducible streams */
+typedef struct rng { unsigned long long s[4]; } *Rng;
+void rng_seed (Rng r, unsigned long long s);
+void rng_stream (Rng r, int k);
+void rng_jump (Rng r);
+Rng rng_default (void);
+void rng_thread (int k);
+unsigned long long rng_next (Rng r);
+double rng_double (Rng r);
+long rng_below (Rng r, long n);
+void rng_fill (Rng r, double *x, long n);
+void rng_fill_dArray (Rng r, dArray arr);
 void init_rand (void);
 double random_number (void);
+double random_array_entry (void);
+void randomizeArray (dArray arr);
+
+/* weighted index samplers over a 1-D dArray */
+typedef struct sampler *Sampler;
+Sampler sampler_alias (dArray dist);
+Sampler sampler_cdf (dArray dist);
+void sampler_reset (Sampler s, dArray dist);
+void sampler_free (Sampler s);
+int sample (Sampler s, Rng r);
+void sample_n (Sampler s, Rng r, iArray out);
+int pick_from_dist (dArray dist);
 
 void auto_remake (char **argv);
 